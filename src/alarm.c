@@ -3,90 +3,268 @@
 #include <stdio.h>
 #include "internal/parlib.h"
 #include "internal/time.h"
-#include "internal/pthread_pool.h"
+#include "internal/futex.h"
+#include <pthread.h>
 #include "alarm.h"
 #include "spinlock.h"
 #include "export.h"
 
-static void *__waiting_thread(void *arg)
+/* All armed alarms live on a single chain, sorted by wakeup_time, and are
+ * fired by one service thread.  Each alarm may fire anywhere in
+ * [wakeup_time, wakeup_time + slack], so the service sleeps until the earliest
+ * of those upper bounds and then fires everything whose wakeup_time has
+ * passed.  Alarms with overlapping windows are thus coalesced into a single
+ * wakeup. */
+static struct {
+	spin_pdr_lock_t lock;
+	struct awaiters_tailq tchain;
+	/* Deadline the service thread is currently sleeping until */
+	uint64_t sleep_until;
+	/* Bumped (and woken) whenever sleep_until needs to move earlier */
+	int futex;
+} alarm_service = {
+	SPINPDR_INITIALIZER,
+	TAILQ_HEAD_INITIALIZER(alarm_service.tchain),
+	(uint64_t)-1,
+	0
+};
+
+/* Latest time at which the earliest alarm on the tchain may fire.  Since the
+ * chain is sorted by wakeup_time and slack is never negative, we can stop
+ * looking once wakeup_time alone passes the best deadline found so far. */
+static uint64_t __tchain_deadline(void)
 {
-	uint64_t wakeup_time, now;
-	struct alarm_waiter *waiter = (struct alarm_waiter*)arg;
-	spinlock_lock(&waiter->lock);
-	do {
-		wakeup_time = waiter->wakeup_time;
-		now = time_usec();
-		if (wakeup_time < now)
+	uint64_t deadline = (uint64_t)-1;
+	struct alarm_waiter *i;
+	TAILQ_FOREACH(i, &alarm_service.tchain, next) {
+		if (i->wakeup_time >= deadline)
+			break;
+		deadline = MIN(deadline, i->wakeup_time + i->slack);
+	}
+	return deadline;
+}
+
+/* Insert the waiter into the tchain.  Returns true if the service thread needs
+ * to be woken up to honor the new deadline.  Hold the service lock. */
+static bool __insert_awaiter(struct alarm_waiter *waiter)
+{
+	struct alarm_waiter *i;
+	TAILQ_FOREACH(i, &alarm_service.tchain, next) {
+		if (i->wakeup_time > waiter->wakeup_time)
 			break;
-		spinlock_unlock(&waiter->lock);
-		usleep(wakeup_time-now);
-		spinlock_lock(&waiter->lock);
-	} while(waiter->wakeup_time != wakeup_time);
-	waiter->done = true;
-	spinlock_unlock(&waiter->lock);
-
-	if (!waiter->unset) {
-		struct event_msg *ev_msg = parlib_malloc(sizeof(struct event_msg));
-		ev_msg->ev_arg3 = waiter;
-		send_event(ev_msg, EV_ALARM, waiter->vcoreid);
+	}
+	if (i)
+		TAILQ_INSERT_BEFORE(i, waiter, next);
+	else
+		TAILQ_INSERT_TAIL(&alarm_service.tchain, waiter, next);
+	waiter->on_tchain = true;
+
+	if (waiter->wakeup_time + waiter->slack < alarm_service.sleep_until) {
+		alarm_service.sleep_until = waiter->wakeup_time + waiter->slack;
+		alarm_service.futex++;
+		return true;
+	}
+	return false;
+}
+
+static void __remove_awaiter(struct alarm_waiter *waiter)
+{
+	TAILQ_REMOVE(&alarm_service.tchain, waiter, next);
+	waiter->on_tchain = false;
+}
+
+/* Events for alarms that fired in the same wakeup, batched per vcore so that
+ * each vcore gets a single queue operation and notification.  Only touched by
+ * the service thread. */
+#define ALARM_BATCH 32
+static struct {
+	struct event_msg *msgs[ALARM_BATCH];
+	size_t count;
+	int vcoreid;
+} alarm_batch;
+
+static void __flush_alarm_batch(void)
+{
+	send_events(alarm_batch.msgs, alarm_batch.count, EV_ALARM,
+	            alarm_batch.vcoreid);
+	alarm_batch.count = 0;
+}
+
+/* The waiter's ev_msg can only be queued once at a time.  If the alarm fires
+ * again before its vcore has handled the previous firing (e.g. a fast periodic
+ * alarm on a busy vcore), the two firings are coalesced into one call to the
+ * waiter's func. */
+static void __fire_awaiter(struct alarm_waiter *waiter)
+{
+	if (__sync_lock_test_and_set(&waiter->ev_pending, true))
+		return;
+	waiter->ev_msg.ev_arg3 = waiter;
+	if (alarm_batch.count &&
+	    (alarm_batch.vcoreid != waiter->vcoreid ||
+	     alarm_batch.count == ALARM_BATCH))
+		__flush_alarm_batch();
+	alarm_batch.vcoreid = waiter->vcoreid;
+	alarm_batch.msgs[alarm_batch.count++] = &waiter->ev_msg;
+}
+
+static void *__alarm_service_thread(void *arg)
+{
+	struct alarm_waiter *waiter;
+	uint64_t now, deadline;
+	int futex;
+
+	while (1) {
+		spin_pdr_lock(&alarm_service.lock);
+		now = time_usec();
+		while ((waiter = TAILQ_FIRST(&alarm_service.tchain)) &&
+		       waiter->wakeup_time <= now) {
+			__remove_awaiter(waiter);
+			__fire_awaiter(waiter);
+			if (waiter->period) {
+				/* Skip over any periods we missed, rather than firing a burst to
+				 * catch up. */
+				waiter->wakeup_time += waiter->period;
+				if (waiter->wakeup_time <= now)
+					waiter->wakeup_time += ROUNDUP(now - waiter->wakeup_time + 1,
+					                               waiter->period);
+				__insert_awaiter(waiter);
+			} else {
+				waiter->done = true;
+			}
+		}
+		deadline = __tchain_deadline();
+		alarm_service.sleep_until = deadline;
+		futex = alarm_service.futex;
+		spin_pdr_unlock(&alarm_service.lock);
+		/* ev_pending keeps these messages from being reused until handled, so
+		 * they can go out without holding the lock. */
+		__flush_alarm_batch();
+
+		if (deadline == (uint64_t)-1)
+			futex_wait(&alarm_service.futex, futex);
+		else if (deadline > now)
+			futex_timed_wait(&alarm_service.futex, futex, deadline - now);
 	}
 	return NULL;
 }
 
-static void init_alarm_service(void)
+static void handler(struct event_msg *ev_msg, unsigned int ev_type)
 {
-	void handler(struct event_msg *ev_msg, unsigned int ev_type)
-	{
-		assert(in_vcore_context());
-		assert(ev_msg);
-		struct alarm_waiter *waiter = (struct alarm_waiter*)ev_msg->ev_arg3;
-		free(ev_msg);
+	assert(in_vcore_context());
+	assert(ev_msg);
+	struct alarm_waiter *waiter = (struct alarm_waiter*)ev_msg->ev_arg3;
+	/* Done with ev_msg, so the service may queue it again from here on */
+	__sync_lock_release(&waiter->ev_pending);
+	/* A periodic alarm may have been unset while this event was in flight. */
+	if (!waiter->unset)
 		waiter->func(waiter);
-	}
+}
+
+/* The service never returns, so it gets a thread of its own rather than
+ * tying up one of the pthread pool's forever. */
+static void init_alarm_service(void)
+{
+	pthread_attr_t attr;
+	pthread_t handle;
+
 	ev_handlers[EV_ALARM] = handler;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&handle, &attr, __alarm_service_thread, NULL))
+		abort();
+	pthread_attr_destroy(&attr);
 }
 
 void EXPORT_SYMBOL init_awaiter(struct alarm_waiter *waiter,
                                 void (*func) (struct alarm_waiter *))
 {
-	run_once_racy(init_alarm_service());
+	run_once(init_alarm_service());
 	waiter->func = func;
 	waiter->wakeup_time = 0;
+	waiter->period = 0;
+	waiter->slack = 0;
 	waiter->unset = false;
 	waiter->done = false;
+	waiter->on_tchain = false;
+	waiter->ev_pending = false;
 	waiter->vcoreid = vcore_id();
-	spinlock_init(&waiter->lock);
+}
+
+/* Moves the waiter to a new wakeup time, resorting it into the tchain if it is
+ * already armed. */
+static void __reset_awaiter(struct alarm_waiter *waiter, uint64_t wakeup_time,
+                            bool arm)
+{
+	bool wake = false;
+	spin_pdr_lock(&alarm_service.lock);
+	if (waiter->on_tchain) {
+		__remove_awaiter(waiter);
+		arm = true;
+	}
+	waiter->wakeup_time = wakeup_time;
+	if (arm) {
+		waiter->unset = false;
+		waiter->done = false;
+		wake = __insert_awaiter(waiter);
+	}
+	spin_pdr_unlock(&alarm_service.lock);
+	if (wake)
+		futex_wakeup_one(&alarm_service.futex);
+}
+
+void EXPORT_SYMBOL set_awaiter_abs(struct alarm_waiter *waiter,
+                                   uint64_t abs_time)
+{
+	__reset_awaiter(waiter, abs_time, false);
 }
 
 void EXPORT_SYMBOL set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep)
 {
-	uint64_t now = time_usec();
-	spinlock_lock(&waiter->lock);
-	waiter->wakeup_time = now + usleep;
-	spinlock_unlock(&waiter->lock);
+	__reset_awaiter(waiter, time_usec() + usleep, false);
 }
 
 void EXPORT_SYMBOL set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 {
 	assert(waiter->wakeup_time);
-	spinlock_lock(&waiter->lock);
-	waiter->wakeup_time += usleep;
-	spinlock_unlock(&waiter->lock);
+	__reset_awaiter(waiter, waiter->wakeup_time + usleep, false);
+}
+
+void EXPORT_SYMBOL set_awaiter_periodic(struct alarm_waiter *waiter,
+                                        uint64_t period)
+{
+	waiter->period = period;
+}
+
+void EXPORT_SYMBOL set_awaiter_slack(struct alarm_waiter *waiter,
+                                     uint64_t slack)
+{
+	waiter->slack = slack;
 }
 
 void EXPORT_SYMBOL set_alarm(struct alarm_waiter *waiter)
 {
-	assert(!waiter->unset);
-	pooled_pthread_start(__waiting_thread, waiter);	
+	assert(!waiter->on_tchain);
+	__reset_awaiter(waiter, waiter->wakeup_time, true);
+}
+
+void EXPORT_SYMBOL reset_alarm_abs(struct alarm_waiter *waiter,
+                                   uint64_t abs_time)
+{
+	__reset_awaiter(waiter, abs_time, true);
 }
 
+/* Returns true if the alarm was disarmed before it went off.  For periodic
+ * alarms, this also suppresses a firing that may already be in flight. */
 bool EXPORT_SYMBOL unset_alarm(struct alarm_waiter *waiter)
 {
-	spinlock_lock(&waiter->lock);
-	if (!waiter->done) {
+	bool was_armed;
+	spin_pdr_lock(&alarm_service.lock);
+	was_armed = waiter->on_tchain;
+	if (was_armed) {
+		__remove_awaiter(waiter);
 		waiter->unset = true;
 	}
-	spinlock_unlock(&waiter->lock);
-	return waiter->unset;
+	spin_pdr_unlock(&alarm_service.lock);
+	/* No need to wake the service; at worst it wakes up once for nothing. */
+	return was_armed;
 }
-
@@ -3,30 +3,46 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "spinlock.h"
+#include <sys/queue.h>
+#include "event.h"
 
 /* Specifc waiter, per alarm */
 struct alarm_waiter {
     void     (*func) (struct alarm_waiter *waiter);
-    uint64_t wakeup_time; /* in usec */  
+    uint64_t wakeup_time; /* in usec */
+    uint64_t period;      /* in usec, 0 for one-shot alarms */
+    uint64_t slack;       /* in usec, how late we may fire to coalesce */
     bool     unset;
     bool     done;
+    bool     on_tchain;
     void     *data;
     int      vcoreid;
-    spinlock_t lock;
+    TAILQ_ENTRY(alarm_waiter) next;
+    /* Event used to deliver the alarm, so firing never allocates */
+    struct event_msg ev_msg;
+    bool     ev_pending;
 };
+TAILQ_HEAD(awaiters_tailq, alarm_waiter);
 
 void init_awaiter(struct alarm_waiter *waiter,
                   void (*func) (struct alarm_waiter *));
-/* Sets the time an awaiter goes off */
+/* Sets the time an awaiter goes off.  Absolute times are in usec on the same
+ * clock as CLOCK_MONOTONIC. */
+void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* Makes the awaiter go off every 'period' usec after its first wakeup time.
+ * Each deadline is computed from the previous one, not from when the alarm
+ * actually fired, so periodic alarms do not drift.  A period of 0 makes the
+ * alarm one-shot again. */
+void set_awaiter_periodic(struct alarm_waiter *waiter, uint64_t period);
+/* Allows the alarm to fire up to 'slack' usec late, so that the service can
+ * fire it together with other alarms in a single wakeup. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t slack);
 /* Arms/disarms the alarm */
 void set_alarm(struct alarm_waiter *waiter);
 bool unset_alarm(struct alarm_waiter *waiter);
-
-// These are defined in akaros so we may need to find a way to implement them...
-//void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
-//void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time); 
+/* Moves the alarm to a new absolute time, arming it if it wasn't armed. */
+void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 
 #endif // PARLIB_ALARM_H
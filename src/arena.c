@@ -0,0 +1,113 @@
+/* See COPYING.LESSER for copyright information. */
+
+#include <stdbool.h>
+#include "internal/parlib.h"
+#include "arena.h"
+#include "slab.h"
+#include "kmalloc.h"
+
+static struct slab_cache *arena_chunk_cache;
+
+static void arena_init(void)
+{
+	arena_chunk_cache = slab_cache_create("arena_chunk", ARENA_CHUNK_SIZE,
+	                                      ARENA_ALIGN, 0, NULL, NULL);
+}
+
+/* Makes 'c' the chunk we bump through, skipping its first 'offset' bytes. */
+static void __arena_use_chunk(struct parlib_arena *arena,
+                              struct arena_chunk *c, size_t offset)
+{
+	arena->ptr = (void*)c + offset;
+	arena->end = (void*)c + c->size;
+}
+
+struct parlib_arena *parlib_arena_create(void)
+{
+	struct arena_chunk *c;
+	struct parlib_arena *arena;
+
+	run_once(arena_init());
+	c = slab_cache_alloc(arena_chunk_cache, 0);
+	c->next = NULL;
+	c->size = ARENA_CHUNK_SIZE;
+	arena = (struct parlib_arena*)(c + 1);
+	arena->chunks = c;
+	arena->large = NULL;
+	arena->allocated = 0;
+	__arena_use_chunk(arena, c, sizeof(*c) + sizeof(*arena));
+	return arena;
+}
+
+void arena_reset(struct parlib_arena *arena)
+{
+	struct arena_chunk *c, *first;
+
+	while ((c = arena->large)) {
+		arena->large = c->next;
+		parlib_kfree(c);
+	}
+	/* The first chunk holds the arena itself, so it stays */
+	for (first = arena->chunks; first->next; first = first->next)
+		;
+	while ((c = arena->chunks) != first) {
+		arena->chunks = c->next;
+		slab_cache_free(arena_chunk_cache, c);
+	}
+	arena->allocated = 0;
+	__arena_use_chunk(arena, first, sizeof(*first) + sizeof(*arena));
+}
+
+void parlib_arena_destroy(struct parlib_arena *arena)
+{
+	struct arena_chunk *first;
+
+	arena_reset(arena);
+	first = arena->chunks;
+	slab_cache_free(arena_chunk_cache, first);
+}
+
+void *arena_alloc(struct parlib_arena *arena, size_t size)
+{
+	struct arena_chunk *c;
+	void *buf;
+
+	size = ROUNDUP(size, ARENA_ALIGN);
+	if (size > arena->end - arena->ptr) {
+		if (size > ARENA_LARGE_SIZE) {
+			c = parlib_kmalloc(sizeof(*c) + size);
+			if (!c)
+				return NULL;
+			c->next = arena->large;
+			c->size = sizeof(*c) + size;
+			arena->large = c;
+			arena->allocated += size;
+			return c + 1;
+		}
+		c = slab_cache_alloc(arena_chunk_cache, 0);
+		c->next = arena->chunks;
+		c->size = ARENA_CHUNK_SIZE;
+		arena->chunks = c;
+		__arena_use_chunk(arena, c, sizeof(*c));
+	}
+	buf = arena->ptr;
+	arena->ptr += size;
+	arena->allocated += size;
+	return buf;
+}
+
+void uthread_set_arena(struct uthread *uthread, struct parlib_arena *arena)
+{
+	uthread->arena = arena;
+}
+
+#undef parlib_arena_create
+#undef parlib_arena_destroy
+#undef arena_alloc
+#undef arena_reset
+#undef uthread_set_arena
+EXPORT_ALIAS(INTERNAL(parlib_arena_create), parlib_arena_create)
+EXPORT_ALIAS(INTERNAL(parlib_arena_destroy), parlib_arena_destroy)
+EXPORT_ALIAS(INTERNAL(arena_alloc), arena_alloc)
+EXPORT_ALIAS(INTERNAL(arena_reset), arena_reset)
+EXPORT_ALIAS(INTERNAL(uthread_set_arena), uthread_set_arena)
@@ -0,0 +1,80 @@
+/* See COPYING.LESSER for copyright information. */
+
+/* Arenas (regions) for objects that all die at the same time, e.g. everything
+ * a request handler allocates.  arena_alloc() just bumps a pointer through the
+ * arena's current chunk, and there is no way to free a single object: the
+ * whole arena is emptied at once with arena_reset().
+ *
+ * Chunks are ARENA_CHUNK_SIZE bytes and come from a slab cache, so a reset
+ * puts them right back into the vcore's magazines, where the next arena on
+ * that vcore picks them up without taking a lock.  Requests bigger than
+ * ARENA_LARGE_SIZE get a buffer of their own from kmalloc instead of wasting
+ * the rest of a chunk.
+ *
+ * An arena is not thread-safe.  It can be attached to a uthread with
+ * uthread_set_arena(), in which case uthread_cleanup() resets and detaches
+ * it.  Whoever created the arena still has to destroy it. */
+
+#ifndef PARLIB_ARENA_H
+#define PARLIB_ARENA_H
+
+#include <stddef.h>
+#include "uthread.h"
+#include "export.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+/* Lives at the start of the arena's first chunk, which is never given back
+ * until the arena is destroyed. */
+struct parlib_arena {
+	struct arena_chunk *chunks;  /* current chunk first */
+	struct arena_chunk *large;   /* buffers bigger than ARENA_LARGE_SIZE */
+	void *ptr;
+	void *end;
+	size_t allocated;            /* bytes handed out since the last reset */
+} __attribute__((aligned(ARENA_ALIGN)));
+
+#ifdef COMPILING_PARLIB
+# define parlib_arena_create INTERNAL(parlib_arena_create)
+# define parlib_arena_destroy INTERNAL(parlib_arena_destroy)
+# define arena_alloc INTERNAL(arena_alloc)
+# define arena_reset INTERNAL(arena_reset)
+# define uthread_set_arena INTERNAL(uthread_set_arena)
+#endif
+
+struct parlib_arena *parlib_arena_create(void);
+void parlib_arena_destroy(struct parlib_arena *arena);
+
+/* Returns size bytes, aligned to ARENA_ALIGN.  NULL only if a large request
+ * can't be mapped. */
+void *arena_alloc(struct parlib_arena *arena, size_t size);
+
+/* Frees everything allocated from the arena. */
+void arena_reset(struct parlib_arena *arena);
+
+/* Attaches an arena to a uthread (NULL detaches), for uthread_arena() and
+ * uthread_cleanup(). */
+void uthread_set_arena(struct uthread *uthread, struct parlib_arena *arena);
+
+/* The arena attached to the current uthread, if any. */
+static inline struct parlib_arena *uthread_arena(void)
+{
+	return current_uthread ? current_uthread->arena : NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARLIB_ARENA_H */
@@ -19,54 +19,64 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 #include "internal/parlib.h"
 #include "dtls.h"
 #include "spinlock.h"
 #include "slab.h"
+#include "kmalloc.h"
+#include "waitfreelist.h"
 
-/* The current dymamic tls implementation uses a locked linked list
- * to find the key for a given thread. We should probably find a better way to
- * do this based on a custom lock-free hash table or something. */
-#include <sys/queue.h>
-#include "spinlock.h"
+/* Every key gets a small integer index when it is created, and each thread
+ * (i.e. vcore or uthread) keeps its values in an array indexed by it, so
+ * getting or setting a value is a bounds check and a load.  The first
+ * DTLS_INLINE_SLOTS values live right in the thread's dtls_data; threads using
+ * keys with higher indices move their values to a bigger array from kmalloc.
+ *
+ * A key's index is only reused once no thread has a value for it anymore,
+ * which the key's ref count tracks: it starts at 1 for the key itself and each
+ * thread with a value set adds 1.  Keys are never freed, just put in a
+ * wait-free list of free keys, index and all, for the next dtls_key_create().
+ *
+ * None of this takes a global lock: keys and dtls data come from slab caches,
+ * which allocate from per-vcore magazines. */
+
+#define DTLS_INLINE_SLOTS 16
 
 /* The dynamic tls key structure */
 struct dtls_key {
   int ref_count;
   bool valid;
   void (*dtor)(void*);
+  size_t index;
 };
 
-/* The definition of a dtls_key list and its elements */
-struct dtls_value {
-  TAILQ_ENTRY(dtls_value) link;
+/* A per-thread slot for one key's value.  The key is only needed to run its
+ * destructor when the thread goes away. */
+struct dtls_slot {
   struct dtls_key *key;
   void *dtls;
-}; 
-TAILQ_HEAD(dtls_list, dtls_value);
+};
 
 /* A struct containing all of the per thread (i.e. vcore or uthread) data
- * associated with dtls */
+ * associated with dtls.  All zeros is a valid, empty dtls_data. */
 typedef struct dtls_data {
-  /* A per-thread list of dtls regions */
-  struct dtls_list list;
-
+  size_t nr_slots;
+  struct dtls_slot *slots;
+  struct dtls_slot inline_slots[DTLS_INLINE_SLOTS];
 } dtls_data_t;
 
 /* A slab of dtls keys (global to all threads) */
 static struct slab_cache *__dtls_keys_cache;
 
-/* A slab of values for use when mapping a dtls_key to its per-thread value */
-struct slab_cache *__dtls_values_cache;
-  
 /* A slab of dtls data for per-thread management */
 struct slab_cache *__dtls_data_cache;
-  
-/* A lock protecting access to the caches above */
-static spin_pdr_lock_t __slab_lock;
+
+/* Released keys, and the next index never handed out */
+static struct wfl __dtls_free_keys = WFL_INITIALIZER(__dtls_free_keys);
+static size_t __dtls_next_index;
 
 static __thread dtls_data_t __dtls_data;
-static __thread bool __dtls_initialized = false;
 
 #ifdef PARLIB_NO_UTHREAD_TLS
 #include "uthread.h"
@@ -74,22 +84,20 @@ static __thread bool __dtls_initialized = false;
 
 static dtls_key_t __allocate_dtls_key() 
 {
-  spin_pdr_lock(&__slab_lock);
-  dtls_key_t key = slab_cache_alloc(__dtls_keys_cache, 0);
-  spin_pdr_unlock(&__slab_lock);
-  assert(key);
+  dtls_key_t key = wfl_remove(&__dtls_free_keys);
+  if (!key) {
+    key = slab_cache_alloc(__dtls_keys_cache, 0);
+    assert(key);
+    key->index = __sync_fetch_and_add(&__dtls_next_index, 1);
+  }
   key->ref_count = 1;
   return key;
 }
 
 static void __maybe_free_dtls_key(dtls_key_t key)
 {
-  __sync_fetch_and_add(&key->ref_count, -1);
-  if(key->ref_count == 0) {
-    spin_pdr_lock(&__slab_lock);
-    slab_cache_free(__dtls_keys_cache, key);
-    spin_pdr_unlock(&__slab_lock);
-  }
+  if (__sync_add_and_fetch(&key->ref_count, -1) == 0)
+    wfl_insert(&__dtls_free_keys, key);
 }
 
 /* Constructor to get a reference to the main thread's TLS descriptor */
@@ -101,14 +109,8 @@ static void dtls_lib_init()
 	  __dtls_keys_cache = slab_cache_create("dtls_keys_cache", 
         sizeof(struct dtls_key), __alignof__(struct dtls_key), 0, NULL, NULL);
 
-	  __dtls_values_cache = slab_cache_create("dtls_values_cache", 
-        sizeof(struct dtls_value), __alignof__(struct dtls_value), 0, NULL, NULL);
-
 	  __dtls_data_cache = slab_cache_create("dtls_data_cache", 
         sizeof(struct dtls_data), __alignof__(struct dtls_data), 0, NULL, NULL);
-
-    /* Initialize the lock that protects the cache */
-    spin_pdr_init(&__slab_lock);
   );
 }
 
@@ -128,94 +130,98 @@ void EXPORT_SYMBOL dtls_key_delete(dtls_key_t key)
   __maybe_free_dtls_key(key);
 }
 
+/* Makes room for slot 'index' in the thread's array of values. */
+static void __grow_dtls(dtls_data_t *dtls_data, size_t index)
+{
+  struct dtls_slot *slots;
+  size_t nr_slots = DTLS_INLINE_SLOTS;
+
+  while (nr_slots <= index)
+    nr_slots *= 2;
+  if (nr_slots == DTLS_INLINE_SLOTS) {
+    slots = dtls_data->inline_slots;
+  } else {
+    slots = parlib_kzmalloc(nr_slots * sizeof(struct dtls_slot));
+    assert(slots);
+    if (dtls_data->nr_slots)
+      memcpy(slots, dtls_data->slots,
+             dtls_data->nr_slots * sizeof(struct dtls_slot));
+    if (dtls_data->slots != dtls_data->inline_slots)
+      parlib_kfree(dtls_data->slots);
+    else
+      memset(dtls_data->inline_slots, 0, sizeof(dtls_data->inline_slots));
+  }
+  dtls_data->slots = slots;
+  dtls_data->nr_slots = nr_slots;
+}
+
 static inline void __set_dtls(dtls_data_t *dtls_data, dtls_key_t key, void *dtls)
 {
   assert(key);
-  __sync_fetch_and_add(&key->ref_count, 1);
-
-  struct dtls_value *v = NULL;
-  TAILQ_FOREACH(v, &dtls_data->list, link)
-    if(v->key == key) break;
+  if (key->index >= dtls_data->nr_slots)
+    __grow_dtls(dtls_data, key->index);
 
-  if(!v) {
-    spin_pdr_lock(&__slab_lock);
-    v = slab_cache_alloc(__dtls_values_cache, 0);
-    spin_pdr_unlock(&__slab_lock);
-    assert(v);
-    v->key = key;
-    TAILQ_INSERT_HEAD(&dtls_data->list, v, link);
+  struct dtls_slot *slot = &dtls_data->slots[key->index];
+  if (!slot->key) {
+    __sync_fetch_and_add(&key->ref_count, 1);
+    slot->key = key;
   }
-  v->dtls = dtls;
+  assert(slot->key == key);
+  slot->dtls = dtls;
 }
 
 static inline void *__get_dtls(dtls_data_t *dtls_data, dtls_key_t key)
 {
   assert(key);
-
-  struct dtls_value *v = NULL;
-  TAILQ_FOREACH(v, &dtls_data->list, link)
-    if(v->key == key) return v->dtls;
-  return v;
+  if (key->index >= dtls_data->nr_slots)
+    return NULL;
+  return dtls_data->slots[key->index].dtls;
 }
 
 static inline void __destroy_dtls(dtls_data_t *dtls_data)
 {
- struct dtls_value *v,*n;
-  v = TAILQ_FIRST(&dtls_data->list);
-  while(v != NULL) {
-    dtls_key_t key = v->key;
-  
+  for (size_t i = 0; i < dtls_data->nr_slots; i++) {
+    struct dtls_slot *slot = &dtls_data->slots[i];
+    dtls_key_t key = slot->key;
+    void *dtls = slot->dtls;
+
+    if (!key)
+      continue;
+    slot->key = NULL;
+    slot->dtls = NULL;
     /* Note, there is a small race here on the valid field, whereby we may run
-     * a destructor on an invalid key. At least the keys memory wont be deleted
+     * a destructor on an invalid key. At least the keys memory wont be reused
      * though, as protected by the ref count. Any reasonable usage of this
      * interface should safeguard that a key is never destroyed before all of the
      * threads that use it have exited anyway. */
-    if(key->dtor) {
-      if(key->valid) {
-        void *dtls = v->dtls;
-        v->dtls = NULL;
-        key->dtor(dtls);
-      }
-    }
+    if(key->dtor && key->valid)
+      key->dtor(dtls);
     __maybe_free_dtls_key(key);
-
-    n = TAILQ_NEXT(v, link);
-    TAILQ_REMOVE(&dtls_data->list, v, link);
-    spin_pdr_lock(&__slab_lock);
-    slab_cache_free(__dtls_values_cache, v);
-    spin_pdr_unlock(&__slab_lock);
-    v = n;
   }
+  if (dtls_data->slots != dtls_data->inline_slots)
+    parlib_kfree(dtls_data->slots);
+  dtls_data->slots = NULL;
+  dtls_data->nr_slots = 0;
 }
 
 void EXPORT_SYMBOL set_dtls(dtls_key_t key, void *dtls)
 {
-  bool initialized = true;
   dtls_data_t *dtls_data = NULL;
 #ifdef PARLIB_NO_UTHREAD_TLS
   if(!in_vcore_context()) {
     assert(current_uthread);
     if(current_uthread->dtls_data == NULL) {
-      spin_pdr_lock(&__slab_lock);
       current_uthread->dtls_data = slab_cache_alloc(__dtls_data_cache, 0);
-      spin_pdr_unlock(&__slab_lock);
-      initialized = false;
+      memset(current_uthread->dtls_data, 0, sizeof(dtls_data_t));
     }
     dtls_data = current_uthread->dtls_data;
   }
   else {
 #endif
-    if(!__dtls_initialized) {
-      initialized = false;
-      __dtls_initialized  = true;
-    }
     dtls_data = &__dtls_data;
 #ifdef PARLIB_NO_UTHREAD_TLS
   }
 #endif
-  if(!initialized) {
-    TAILQ_INIT(&dtls_data->list);
-  }
   __set_dtls(dtls_data, key, dtls);
 }
 
@@ -231,8 +237,6 @@ void EXPORT_SYMBOL *get_dtls(dtls_key_t key)
   }
   else {
 #endif
-    if(!__dtls_initialized)
-      return NULL;
     dtls_data = &__dtls_data;
 #ifdef PARLIB_NO_UTHREAD_TLS
   }
@@ -251,8 +255,6 @@ void EXPORT_SYMBOL destroy_dtls()
   }
   else {
 #endif
-    if(!__dtls_initialized)
-      return;
     dtls_data = &__dtls_data;
 #ifdef PARLIB_NO_UTHREAD_TLS
   }
@@ -261,9 +263,10 @@ void EXPORT_SYMBOL destroy_dtls()
   __destroy_dtls(dtls_data);
 
 #ifdef PARLIB_NO_UTHREAD_TLS
-  spin_pdr_lock(&__slab_lock);
-  slab_cache_free(__dtls_data_cache, dtls_data);
-  spin_pdr_unlock(&__slab_lock);
+  if(dtls_data != &__dtls_data) {
+    current_uthread->dtls_data = NULL;
+    slab_cache_free(__dtls_data_cache, dtls_data);
+  }
 #endif
 }
 
@@ -2,81 +2,332 @@
 /* Kevin Klues <klueska@cs.berkeley.edu>	*/
 
 #include "internal/parlib.h"
-#include <sys/queue.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include "parlib.h"
 #include "vcore.h"
 #include "event.h"
 #include "spinlock.h"
 #include "atomic.h"
+#include "kmalloc.h"
+#include "histogram.h"
 
-struct pvc_event_msg {
-	struct event_msg *ev_msg;
-	STAILQ_ENTRY(pvc_event_msg) next;
-};
-STAILQ_HEAD(pvc_event_queue, pvc_event_msg);
-
+/* Each vcore has an intrusive multi-producer/single-consumer queue of
+ * event_msgs, linked through event_msg->next (Dmitry Vyukov's MPSC node-based
+ * queue).  Producers append with a single atomic swap on evq_head and never
+ * touch evq_tail.  Only the owning vcore dequeues, from evq_tail, without any
+ * atomics at all.  The stub message keeps the queue from ever being truly
+ * empty, so producers and the consumer never contend on the same node. */
 struct vc_mgmt {
-	struct pvc_event_queue evq;
-	spin_pdr_lock_t evq_lock;
+	/* Written by producers */
+	struct event_msg *evq_head;
 	atomic_t notifs_enabled;
+	/* Set by the first producer after the vcore last started draining its
+	 * queue.  Only that producer notifies the vcore, so a burst of events costs a
+	 * single signal no matter how many producers take part in it. */
 	atomic_t notif_pending;
+	/* Only touched by the vcore itself */
+	struct event_msg *evq_tail __attribute__((aligned(ARCH_CL_SIZE)));
+	struct event_msg evq_stub;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
 static struct vc_mgmt *vc_mgmt;
 
+/* Runtime-allocated event types.  Registration is rare, so a lock will do;
+ * handle_events() reads the table without it, since no event of a type can be
+ * sent before the type has been registered. */
+static struct ev_type {
+	bool in_use;
+	handle_event_data_t handler;
+	handle_event_batch_t batch_handler;
+	void *data;
+} ev_types[MAX_NR_EVENT];
+static spin_pdr_lock_t ev_types_lock = SPINPDR_INITIALIZER;
+
+/* Appends the chain first..last, already linked through ->next, in one go. */
+static inline void __evq_push_chain(struct vc_mgmt *vcm,
+                                    struct event_msg *first,
+                                    struct event_msg *last)
+{
+	struct event_msg *prev;
+	last->next = NULL;
+	prev = atomic_swap_ptr((void**)&vcm->evq_head, last);
+	/* The queue is briefly disconnected between the swap and this store.  The
+	 * consumer treats that as empty, and we notify it after we return. */
+	prev->next = first;
+}
+
+static inline void __evq_push(struct vc_mgmt *vcm, struct event_msg *ev_msg)
+{
+	__evq_push_chain(vcm, ev_msg, ev_msg);
+}
+
+static inline struct event_msg *__evq_pop(struct vc_mgmt *vcm)
+{
+	struct event_msg *tail, *next;
+
+	cmb(); /* producers change next and evq_head behind our back */
+	tail = vcm->evq_tail;
+	next = tail->next;
+
+	if (tail == &vcm->evq_stub) {
+		if (next == NULL)
+			return NULL;
+		vcm->evq_tail = next;
+		tail = next;
+		next = next->next;
+	}
+	if (next) {
+		vcm->evq_tail = next;
+		return tail;
+	}
+	/* tail is the last message.  Unless a producer is midway through a push,
+	 * put the stub back behind it so we can hand tail out. */
+	if (tail != vcm->evq_head)
+		return NULL;
+	__evq_push(vcm, &vcm->evq_stub);
+	next = tail->next;
+	if (next) {
+		vcm->evq_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* A function call shipped to another vcore.  For synchronous calls, the
+ * message lives on the caller's stack and 'pending' counts the targets that
+ * have yet to run it.  Asynchronous calls are malloced and freed by the target
+ * once it has run them. */
+struct vcore_call_msg {
+	struct event_msg ev_msg;
+	void (*func)(void *);
+	void *arg;
+	volatile int *pending;
+};
+
+static void __vcore_call_handler(struct event_msg *ev_msg, unsigned ev_type)
+{
+	struct vcore_call_msg *call = (struct vcore_call_msg*)ev_msg;
+	volatile int *pending = call->pending;
+
+	call->func(call->arg);
+	if (pending)
+		/* The caller may unwind its stack (and call) right after this */
+		__sync_fetch_and_sub(pending, 1);
+	else
+		parlib_kfree(call);
+}
+
 void event_lib_init()
 {
 	vc_mgmt = parlib_aligned_alloc(PGSIZE,
 	            sizeof(struct vc_mgmt) * max_vcores());
 	for (int i=0; i<max_vcores(); i++) {
-		STAILQ_INIT(&(vc_mgmt[i].evq));
-		spin_pdr_init(&(vc_mgmt[i].evq_lock));
+		vc_mgmt[i].evq_stub.next = NULL;
+		vc_mgmt[i].evq_stub.ev_type = EV_NONE;
+		vc_mgmt[i].evq_head = &vc_mgmt[i].evq_stub;
+		vc_mgmt[i].evq_tail = &vc_mgmt[i].evq_stub;
 		vc_mgmt[i].notifs_enabled = ATOMIC_INITIALIZER(1);
 		vc_mgmt[i].notif_pending = ATOMIC_INITIALIZER(0);
 	}
+	ev_handlers[EV_USER_IPI] = __vcore_call_handler;
+}
+
+/* Called after pushing onto a vcore's queue.  The swap orders our push before
+ * the check, so either we see notif_pending clear and notify, or the vcore has
+ * not cleared it yet and will find our events when it drains. */
+static inline void __notify_vcore(int vcoreid)
+{
+	struct vc_mgmt *vcm = &vc_mgmt[vcoreid];
+	if (atomic_swap(&vcm->notif_pending, 1) == 1)
+		return;
+	/* If notifs are disabled, enable_notifs() sends this signal for us */
+	if (atomic_read(&vcm->notifs_enabled))
+		vcore_signal(vcoreid);
 }
 
 void send_event(struct event_msg *ev_msg, unsigned ev_type, int vcoreid)
 {
-	struct pvc_event_msg *m = parlib_malloc(sizeof(struct pvc_event_msg));
-	m->ev_msg = ev_msg;
-	m->ev_msg->ev_type = ev_type;
-	spin_pdr_lock(&(vc_mgmt[vcoreid].evq_lock));
-	STAILQ_INSERT_TAIL(&(vc_mgmt[vcoreid].evq), m, next);
-	spin_pdr_unlock(&(vc_mgmt[vcoreid].evq_lock));
+	ev_msg->ev_type = ev_type;
+#ifdef PARLIB_HISTOGRAMS
+	ev_msg->sent_at = parlib_hist_begin();
+#endif
+	__evq_push(&vc_mgmt[vcoreid], ev_msg);
+	__notify_vcore(vcoreid);
+}
 
-	atomic_set(&vc_mgmt[vcoreid].notif_pending, 1);
-	if (atomic_read(&vc_mgmt[vcoreid].notifs_enabled)) {
-		atomic_set(&vc_mgmt[vcoreid].notif_pending, 0);
-		vcore_signal(vcoreid);
+/* Sends 'count' events of the same type to a vcore with a single queue
+ * operation and at most one notification. */
+void send_events(struct event_msg **ev_msgs, size_t count, unsigned ev_type,
+                 int vcoreid)
+{
+#ifdef PARLIB_HISTOGRAMS
+	uint64_t sent_at = parlib_hist_begin();
+#endif
+
+	if (count == 0)
+		return;
+	for (size_t i = 0; i < count; i++) {
+		ev_msgs[i]->ev_type = ev_type;
+#ifdef PARLIB_HISTOGRAMS
+		ev_msgs[i]->sent_at = sent_at;
+#endif
+		if (i > 0)
+			ev_msgs[i - 1]->next = ev_msgs[i];
 	}
+	__evq_push_chain(&vc_mgmt[vcoreid], ev_msgs[0], ev_msgs[count - 1]);
+	__notify_vcore(vcoreid);
+}
+
+int register_ev_type(handle_event_data_t handler,
+                     handle_event_batch_t batch_handler, void *data)
+{
+	int ev_type = -1;
+
+	assert(handler || batch_handler);
+	spin_pdr_lock(&ev_types_lock);
+	for (int i = EV_NR_STATIC; i < MAX_NR_EVENT; i++) {
+		if (!ev_types[i].in_use) {
+			ev_types[i].handler = handler;
+			ev_types[i].batch_handler = batch_handler;
+			ev_types[i].data = data;
+			ev_types[i].in_use = true;
+			ev_type = i;
+			break;
+		}
+	}
+	spin_pdr_unlock(&ev_types_lock);
+	return ev_type;
+}
+
+void deregister_ev_type(unsigned ev_type)
+{
+	assert(ev_type >= EV_NR_STATIC && ev_type < MAX_NR_EVENT);
+	spin_pdr_lock(&ev_types_lock);
+	assert(ev_types[ev_type].in_use);
+	memset(&ev_types[ev_type], 0, sizeof(struct ev_type));
+	spin_pdr_unlock(&ev_types_lock);
+}
+
+static void __handle_event(struct event_msg *ev_msg)
+{
+	unsigned ev_type = ev_msg->ev_type;
+	if (ev_type < EV_NR_STATIC)
+		ev_handlers[ev_type](ev_msg, ev_type);
+	else
+		ev_types[ev_type].handler(ev_msg, ev_type, ev_types[ev_type].data);
 }
 
 void handle_events()
 {
-	struct pvc_event_msg *m;
-	int vcoreid = vcore_id();
-	/* Only we will ever dequeue, so race with m is ok. */
-	while ((m = STAILQ_FIRST(&(vc_mgmt[vcoreid].evq)))) {
-		spin_pdr_lock(&(vc_mgmt[vcoreid].evq_lock));
-		STAILQ_REMOVE_HEAD(&(vc_mgmt[vcoreid].evq), next);
-		spin_pdr_unlock(&(vc_mgmt[vcoreid].evq_lock));
-
-		if (m->ev_msg->ev_type != EV_NONE) {
-			handle_event_t handler = ev_handlers[m->ev_msg->ev_type];
-			handler(m->ev_msg, m->ev_msg->ev_type);
+	struct event_msg *ev_msg;
+	struct vc_mgmt *vcm = &vc_mgmt[vcore_id()];
+	struct event_msg *batch[EV_MAX_BATCH];
+	size_t count = 0;
+	unsigned batch_type = EV_NONE;
+
+	/* Clear notif_pending before draining, so that any event we miss below was
+	 * pushed by a producer that will notify us again. */
+	atomic_swap(&vcm->notif_pending, 0);
+	while (1) {
+		ev_msg = __evq_pop(vcm);
+		/* Hand out the current batch once it can no longer grow */
+		if (count && (!ev_msg || ev_msg->ev_type != batch_type ||
+		              count == EV_MAX_BATCH)) {
+			ev_types[batch_type].batch_handler(batch, count, batch_type,
+			                                   ev_types[batch_type].data);
+			count = 0;
 		}
-		free(m);
+		if (!ev_msg)
+			break;
+		if (ev_msg->ev_type == EV_NONE)
+			continue;
+#ifdef PARLIB_HISTOGRAMS
+		parlib_hist_end(event_latency, ev_msg->sent_at);
+#endif
+		if (ev_msg->ev_type >= EV_NR_STATIC &&
+		    ev_types[ev_msg->ev_type].batch_handler &&
+		    !ev_types[ev_msg->ev_type].handler) {
+			batch_type = ev_msg->ev_type;
+			batch[count++] = ev_msg;
+			continue;
+		}
+		__handle_event(ev_msg);
+	}
+}
+
+static void __vcore_call_post(struct vcore_call_msg *call, int vcoreid,
+                              void (*func)(void *), void *arg,
+                              volatile int *pending)
+{
+	assert(vcoreid >= 0 && vcoreid < max_vcores());
+	call->func = func;
+	call->arg = arg;
+	call->pending = pending;
+	send_event(&call->ev_msg, EV_USER_IPI, vcoreid);
+}
+
+static void __vcore_call_wait(volatile int *pending)
+{
+	while (*pending) {
+		if (in_vcore_context())
+			handle_events();
+		cpu_relax();
 	}
 }
 
+void vcore_call(int vcoreid, void (*func)(void *), void *arg)
+{
+	/* Usually freed on another vcore, which kmalloc handles without locks */
+	struct vcore_call_msg *call = parlib_kmalloc(sizeof(struct vcore_call_msg));
+	__vcore_call_post(call, vcoreid, func, arg, NULL);
+}
+
+void vcore_call_many(uint64_t vcore_mask, void (*func)(void *), void *arg)
+{
+	for (int i = 0; vcore_mask; i++, vcore_mask >>= 1)
+		if (vcore_mask & 1)
+			vcore_call(i, func, arg);
+}
+
+void vcore_call_sync(int vcoreid, void (*func)(void *), void *arg)
+{
+	struct vcore_call_msg call;
+	volatile int pending = 1;
+
+	/* Calling ourselves from vcore context; just run it. */
+	if (in_vcore_context() && vcoreid == vcore_id()) {
+		func(arg);
+		return;
+	}
+	__vcore_call_post(&call, vcoreid, func, arg, &pending);
+	__vcore_call_wait(&pending);
+}
+
+void vcore_call_many_sync(uint64_t vcore_mask, void (*func)(void *),
+                          void *arg)
+{
+	struct vcore_call_msg *calls;
+	volatile int pending = __builtin_popcountll(vcore_mask);
+
+	if (!pending)
+		return;
+	calls = parlib_kmalloc(sizeof(struct vcore_call_msg) * pending);
+	for (int i = 0, n = 0; vcore_mask; i++, vcore_mask >>= 1)
+		if (vcore_mask & 1)
+			__vcore_call_post(&calls[n++], i, func, arg, &pending);
+	__vcore_call_wait(&pending);
+	parlib_kfree(calls);
+}
+
 /* Enables notifs, and deals with missed notifs by self notifying.  This should
- * be rare, so the syscall overhead isn't a big deal. */
+ * be rare, so the syscall overhead isn't a big deal.  notif_pending stays set
+ * until the vcore drains its queue, so producers keep quiet in the meantime. */
 void enable_notifs(uint32_t vcoreid)
 {
-	atomic_set(&vc_mgmt[vcoreid].notifs_enabled, 1);
-	if (atomic_swap(&vc_mgmt[vcoreid].notif_pending, 0) == 1)
+	atomic_swap(&vc_mgmt[vcoreid].notifs_enabled, 1);
+	if (atomic_read(&vc_mgmt[vcoreid].notif_pending))
 		vcore_signal(vcoreid);
 }
 
@@ -87,11 +338,25 @@ void disable_notifs(uint32_t vcoreid)
 
 #undef event_lib_init
 #undef send_event
+#undef send_events
 #undef handle_events
 #undef enable_notifs
 #undef disable_notifs
+#undef register_ev_type
+#undef deregister_ev_type
+#undef vcore_call
+#undef vcore_call_many
+#undef vcore_call_sync
+#undef vcore_call_many_sync
 EXPORT_ALIAS(INTERNAL(event_lib_init), event_lib_init)
 EXPORT_ALIAS(INTERNAL(send_event), send_event)
+EXPORT_ALIAS(INTERNAL(send_events), send_events)
 EXPORT_ALIAS(INTERNAL(handle_events), handle_events)
 EXPORT_ALIAS(INTERNAL(enable_notifs), enable_notifs)
 EXPORT_ALIAS(INTERNAL(disable_notifs), disable_notifs)
+EXPORT_ALIAS(INTERNAL(register_ev_type), register_ev_type)
+EXPORT_ALIAS(INTERNAL(deregister_ev_type), deregister_ev_type)
+EXPORT_ALIAS(INTERNAL(vcore_call), vcore_call)
+EXPORT_ALIAS(INTERNAL(vcore_call_many), vcore_call_many)
+EXPORT_ALIAS(INTERNAL(vcore_call_sync), vcore_call_sync)
+EXPORT_ALIAS(INTERNAL(vcore_call_many_sync), vcore_call_many_sync)
@@ -5,12 +5,24 @@
 #ifndef PARLIB_EVENT_H
 #define PARLIB_EVENT_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include "export.h"
+#include "parlib-config.h"
+
 #ifdef COMPILING_PARLIB
 # define event_lib_init INTERNAL(event_lib_init)
 # define send_event INTERNAL(send_event)
+# define send_events INTERNAL(send_events)
 # define handle_events INTERNAL(handle_events)
 # define enable_notifs INTERNAL(enable_notifs)
 # define disable_notifs INTERNAL(disable_notifs)
+# define register_ev_type INTERNAL(register_ev_type)
+# define deregister_ev_type INTERNAL(deregister_ev_type)
+# define vcore_call INTERNAL(vcore_call)
+# define vcore_call_many INTERNAL(vcore_call_many)
+# define vcore_call_sync INTERNAL(vcore_call_sync)
+# define vcore_call_many_sync INTERNAL(vcore_call_many_sync)
 #endif
 
 // Akaros event compatibility layer
@@ -18,27 +30,70 @@ struct syscall {
   void *u_data;
 };
 struct event_msg {
+  /* Link for the per-vcore event queue.  A message can only be queued once at
+   * a time, and must stay valid until its handler has run. */
+  struct event_msg *next;
   unsigned ev_type;
   uint16_t ev_arg1;
   uint32_t ev_arg2;
   void *ev_arg3;
   uint64_t ev_arg4;
   struct syscall sysc;
+#ifdef PARLIB_HISTOGRAMS
+  uint64_t sent_at;  /* for parlib_event_latency_hist */
+#endif
 };
 
 #define EV_NONE 0
 #define EV_SYSCALL 1
 #define EV_ALARM 2
 #define EV_USER_IPI 3
-#define MAX_NR_EVENT 4
+#define EV_NR_STATIC 4   /* types above this are handed out at runtime */
+#define MAX_NR_EVENT 64
 
+/* Handlers for the static types are installed directly in ev_handlers. */
 typedef void (*handle_event_t)(struct event_msg *ev_msg, unsigned ev_type);
 extern handle_event_t ev_handlers[MAX_NR_EVENT];
 
+/* Handlers for types allocated with register_ev_type().  A batch handler is
+ * passed every message of its type that sits back to back in the vcore's
+ * event queue (up to EV_MAX_BATCH at a time), instead of one call each.
+ * Messages of different types are still handled in the order they arrived. */
+#define EV_MAX_BATCH 32
+typedef void (*handle_event_data_t)(struct event_msg *ev_msg, unsigned ev_type,
+                                    void *data);
+typedef void (*handle_event_batch_t)(struct event_msg **ev_msgs, size_t count,
+                                     unsigned ev_type, void *data);
+
 void event_lib_init();
 void send_event(struct event_msg *ev_msg, unsigned ev_type, int vcoreid);
+/* Sends a batch of events of the same type to one vcore.  A vcore is notified
+ * at most once until it next drains its queue, however many events arrive. */
+void send_events(struct event_msg **ev_msgs, size_t count, unsigned ev_type,
+                 int vcoreid);
 void handle_events();
 
+/* Allocates a new event type, whose events are passed to 'handler' or, if it is
+ * NULL, to 'batch_handler', along with 'data'.  Returns the new type, or -1 if
+ * all MAX_NR_EVENT types are in use. */
+int register_ev_type(handle_event_data_t handler,
+                     handle_event_batch_t batch_handler, void *data);
+/* Releases an event type.  No events of that type may still be in flight. */
+void deregister_ev_type(unsigned ev_type);
+
+/* Runs func(arg) in vcore context on another vcore, delivered as an
+ * EV_USER_IPI event.  Calls to the same vcore run in the order they were made,
+ * and a burst of them costs that vcore a single notification.  vcore_call_many
+ * takes a bitmask of vcore ids.  The _sync variants return once func has
+ * returned on every target; while waiting in vcore context, they keep handling
+ * the caller's own events so that two vcores calling each other can't
+ * deadlock. */
+void vcore_call(int vcoreid, void (*func)(void *), void *arg);
+void vcore_call_many(uint64_t vcore_mask, void (*func)(void *), void *arg);
+void vcore_call_sync(int vcoreid, void (*func)(void *), void *arg);
+void vcore_call_many_sync(uint64_t vcore_mask, void (*func)(void *),
+                          void *arg);
+
 void clear_notif_pending(uint32_t vcoreid);
 void enable_notifs(uint32_t vcoreid);
 void disable_notifs(uint32_t vcoreid);
@@ -0,0 +1,185 @@
+/* See COPYING.LESSER for copyright information. */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "internal/parlib.h"
+#include "histogram.h"
+#include "atomic.h"
+
+#ifdef PARLIB_HISTOGRAMS
+struct histogram EXPORT_SYMBOL parlib_lock_hold_hist =
+	HISTOGRAM_INITIALIZER("spin_pdr lock hold time", HIST_TSC);
+struct histogram EXPORT_SYMBOL parlib_event_latency_hist =
+	HISTOGRAM_INITIALIZER("event delivery latency", HIST_TSC);
+struct histogram EXPORT_SYMBOL parlib_syscall_park_hist =
+	HISTOGRAM_INITIALIZER("syscall park time", HIST_TSC);
+#endif
+
+static void __init_counts(struct histogram_counts *c)
+{
+	memset(c, 0, sizeof(struct histogram_counts));
+	c->min = (uint64_t)-1;
+}
+
+struct histogram *histogram_create(const char *name, int flags)
+{
+	struct histogram *h = parlib_aligned_alloc(ARCH_CL_SIZE,
+	                                           sizeof(struct histogram));
+	h->name = name;
+	h->flags = flags;
+	memset(h->shards, 0, sizeof(h->shards));
+	__init_counts(&h->shared);
+	return h;
+}
+
+void histogram_destroy(struct histogram *h)
+{
+	for (int i = 0; i < MAX_VCORES; i++)
+		if (h->shards[i])
+			munmap(h->shards[i], sizeof(struct histogram_counts));
+	free(h);
+}
+
+/* Called the first time a vcore records into this histogram.  Only this vcore
+ * ever installs its own shard, so no synchronization is needed beyond making
+ * sure the shard is initialized before it becomes visible to snapshots.
+ * Shards come straight from mmap rather than malloc, since the allocator's own
+ * locks record into parlib_lock_hold_hist. */
+struct histogram_counts *__histogram_alloc_shard(struct histogram *h,
+                                                 int vcoreid)
+{
+	struct histogram_counts *c;
+	c = mmap(0, sizeof(struct histogram_counts), PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+		abort();
+	__init_counts(c);
+	wmb();
+	h->shards[vcoreid] = c;
+	return c;
+}
+
+void __histogram_record_shared(struct histogram *h, uint64_t value)
+{
+	struct histogram_counts *c = &h->shared;
+	uint64_t old;
+
+	__sync_fetch_and_add(&c->counts[histogram_bucket(value)], 1);
+	__sync_fetch_and_add(&c->total, 1);
+	__sync_fetch_and_add(&c->sum, value);
+	while (value < (old = c->min))
+		if (__sync_bool_compare_and_swap(&c->min, old, value))
+			break;
+	while (value > (old = c->max))
+		if (__sync_bool_compare_and_swap(&c->max, old, value))
+			break;
+}
+
+void histogram_reset(struct histogram *h)
+{
+	for (int i = 0; i < MAX_VCORES; i++)
+		if (h->shards[i])
+			__init_counts(h->shards[i]);
+	__init_counts(&h->shared);
+}
+
+static void __merge_counts(struct histogram_counts *dst,
+                           struct histogram_counts *src)
+{
+	if (src->total == 0)
+		return;
+	for (int i = 0; i < HIST_NR_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+void histogram_snapshot(struct histogram *h, struct histogram_counts *out)
+{
+	__init_counts(out);
+	for (int i = 0; i < MAX_VCORES; i++)
+		if (h->shards[i])
+			__merge_counts(out, h->shards[i]);
+	__merge_counts(out, &h->shared);
+}
+
+uint64_t histogram_percentile(struct histogram_counts *c, double pct)
+{
+	uint64_t target, seen = 0;
+
+	if (c->total == 0)
+		return 0;
+	target = (uint64_t)(pct / 100.0 * c->total + 0.5);
+	if (target == 0)
+		target = 1;
+	if (target > c->total)
+		target = c->total;
+	for (int i = 0; i < HIST_NR_BUCKETS; i++) {
+		seen += c->counts[i];
+		if (seen >= target) {
+			/* The top of this bucket is the bottom of the next one, minus one */
+			uint64_t top = i + 1 < HIST_NR_BUCKETS ?
+			               histogram_bucket_value(i + 1) - 1 : (uint64_t)-1;
+			return MIN(top, c->max);
+		}
+	}
+	return c->max;
+}
+
+static unsigned long __hist_val(struct histogram *h, uint64_t v)
+{
+	return h->flags & HIST_TSC ? tsc2nsec(v) : v;
+}
+
+void EXPORT_SYMBOL print_histogram(struct histogram *h)
+{
+	static const double pcts[] = {50, 90, 99, 99.9, 99.99};
+	struct histogram_counts *c;
+	const char *unit = h->flags & HIST_TSC ? " ns" : "";
+
+	c = parlib_aligned_alloc(ARCH_CL_SIZE, sizeof(struct histogram_counts));
+	histogram_snapshot(h, c);
+	printf("\nPrinting histogram:\n---------------------\n");
+	printf("Name: %s\n", h->name);
+	printf("Count: %lu\n", (unsigned long)c->total);
+	if (c->total) {
+		printf("Min: %lu%s\n", __hist_val(h, c->min), unit);
+		printf("Mean: %lu%s\n", __hist_val(h, c->sum / c->total), unit);
+		for (int i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+			printf("P%g: %lu%s\n", pcts[i],
+			       __hist_val(h, histogram_percentile(c, pcts[i])), unit);
+		printf("Max: %lu%s\n", __hist_val(h, c->max), unit);
+	}
+	free(c);
+}
+
+#ifdef PARLIB_HISTOGRAMS
+void print_parlib_histograms()
+{
+	print_histogram(&parlib_lock_hold_hist);
+	print_histogram(&parlib_event_latency_hist);
+	print_histogram(&parlib_syscall_park_hist);
+}
+#endif
+
+#undef histogram_create
+#undef histogram_destroy
+#undef histogram_reset
+#undef histogram_snapshot
+#undef histogram_percentile
+#undef __histogram_alloc_shard
+#undef __histogram_record_shared
+#undef print_parlib_histograms
+EXPORT_ALIAS(INTERNAL(histogram_create), histogram_create)
+EXPORT_ALIAS(INTERNAL(histogram_destroy), histogram_destroy)
+EXPORT_ALIAS(INTERNAL(histogram_reset), histogram_reset)
+EXPORT_ALIAS(INTERNAL(histogram_snapshot), histogram_snapshot)
+EXPORT_ALIAS(INTERNAL(histogram_percentile), histogram_percentile)
+EXPORT_ALIAS(INTERNAL(__histogram_alloc_shard), __histogram_alloc_shard)
+EXPORT_ALIAS(INTERNAL(__histogram_record_shared), __histogram_record_shared)
+#ifdef PARLIB_HISTOGRAMS
+EXPORT_ALIAS(INTERNAL(print_parlib_histograms), print_parlib_histograms)
+#endif
@@ -0,0 +1,174 @@
+/* See COPYING.LESSER for copyright information. */
+
+/* Latency histograms with log-linear buckets, in the style of HdrHistogram.
+ *
+ * Values below 2^HIST_SUB_BUCKET_BITS each get their own bucket.  Above that,
+ * every power of two is split into 2^HIST_SUB_BUCKET_BITS equal sub-buckets,
+ * so a recorded value is off by at most 1/32 (~3%) of itself, across the full
+ * 64 bit range.
+ *
+ * Each vcore records into its own cache-line-aligned shard with plain
+ * (non-atomic) increments.  Shards are allocated the first time a vcore
+ * records into a histogram, and are only merged when someone asks for a
+ * snapshot.  Callers outside of vcore/uthread context (e.g. backing pthreads)
+ * share one extra shard, updated atomically.  A uthread that migrates to a
+ * different vcore right in the middle of a record can race with that vcore and
+ * lose a count, which is fine for statistics. */
+
+#ifndef PARLIB_HISTOGRAM_H
+#define PARLIB_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "common.h"
+#include "vcore.h"
+#include "timing.h"
+#include "export.h"
+#include "parlib-config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIST_SUB_BUCKET_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_NR_BUCKETS ((64 - HIST_SUB_BUCKET_BITS + 1) << HIST_SUB_BUCKET_BITS)
+
+/* Histogram flags */
+#define HIST_TSC 0x0001 /* values are tsc ticks; report them in nsec */
+
+/* Counts for a single shard, or the merged counts of a whole histogram */
+struct histogram_counts {
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t counts[HIST_NR_BUCKETS];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct histogram {
+	const char *name;
+	int flags;
+	struct histogram_counts *shards[MAX_VCORES];
+	struct histogram_counts shared;
+};
+
+/* For histograms that are statically allocated rather than created */
+#define HISTOGRAM_INITIALIZER(hname, hflags) \
+	{ .name = (hname), .flags = (hflags), .shared = { .min = (uint64_t)-1 } }
+
+#ifdef COMPILING_PARLIB
+# define histogram_create INTERNAL(histogram_create)
+# define histogram_destroy INTERNAL(histogram_destroy)
+# define histogram_reset INTERNAL(histogram_reset)
+# define histogram_snapshot INTERNAL(histogram_snapshot)
+# define histogram_percentile INTERNAL(histogram_percentile)
+# define __histogram_alloc_shard INTERNAL(__histogram_alloc_shard)
+# define __histogram_record_shared INTERNAL(__histogram_record_shared)
+# define print_parlib_histograms INTERNAL(print_parlib_histograms)
+#endif
+
+/* Create/destroy a histogram.  Destroying a histogram that is still being
+ * recorded into is a bug. */
+struct histogram *histogram_create(const char *name, int flags);
+void histogram_destroy(struct histogram *h);
+
+/* Zero all counts.  Not synchronized with concurrent records. */
+void histogram_reset(struct histogram *h);
+
+/* Merge all shards into 'out'.  Not synchronized with concurrent records, so
+ * the result is a close approximation while recording is still going on. */
+void histogram_snapshot(struct histogram *h, struct histogram_counts *out);
+
+/* Return the value at or below which 'pct' percent (0-100) of all recorded
+ * values fall, reported as the top of its bucket and capped at the max. */
+uint64_t histogram_percentile(struct histogram_counts *c, double pct);
+
+/* Print a summary of the histogram (count, mean and percentiles) to stdout. */
+void print_histogram(struct histogram *h);
+
+/* Internal slow paths of histogram_record(). */
+struct histogram_counts *__histogram_alloc_shard(struct histogram *h,
+                                                 int vcoreid);
+void __histogram_record_shared(struct histogram *h, uint64_t value);
+
+/* Index of the bucket a value falls into. */
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+	unsigned int msb, shift;
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HIST_SUB_BUCKET_BITS;
+	return ((shift + 1) << HIST_SUB_BUCKET_BITS) +
+	       (unsigned int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Smallest value that falls into a bucket. */
+static inline uint64_t histogram_bucket_value(unsigned int bucket)
+{
+	unsigned int shift;
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+	shift = (bucket >> HIST_SUB_BUCKET_BITS) - 1;
+	return (uint64_t)(HIST_SUB_BUCKETS + (bucket & (HIST_SUB_BUCKETS - 1)))
+	       << shift;
+}
+
+/* Record a value into the calling vcore's shard. */
+static inline void histogram_record(struct histogram *h, uint64_t value)
+{
+	int vcoreid = vcore_id();
+	struct histogram_counts *c;
+
+	if (unlikely(vcoreid < 0)) {
+		__histogram_record_shared(h, value);
+		return;
+	}
+	c = h->shards[vcoreid];
+	if (unlikely(c == NULL))
+		c = __histogram_alloc_shard(h, vcoreid);
+	c->counts[histogram_bucket(value)]++;
+	c->total++;
+	c->sum += value;
+	if (value < c->min)
+		c->min = value;
+	if (value > c->max)
+		c->max = value;
+}
+
+/* Record the number of tsc ticks elapsed since 'begin' (from read_tsc()). */
+static inline void histogram_record_since(struct histogram *h, uint64_t begin)
+{
+	histogram_record(h, read_tsc() - begin);
+}
+
+/* When configured with --enable-histograms, parlib times some of its own paths
+ * into these, all in tsc ticks:
+ *   parlib_lock_hold_hist: how long spin_pdr locks are held
+ *   parlib_event_latency_hist: from send_event() until the target vcore
+ *     handles the event
+ *   parlib_syscall_park_hist: how long a uthread stays parked on a blocking
+ *     syscall
+ * parlib_hist_begin() and parlib_hist_end() compile to nothing otherwise. */
+#ifdef PARLIB_HISTOGRAMS
+extern struct histogram parlib_lock_hold_hist;
+extern struct histogram parlib_event_latency_hist;
+extern struct histogram parlib_syscall_park_hist;
+
+/* Print all of the histograms above */
+void print_parlib_histograms();
+
+# define parlib_hist_begin() read_tsc()
+# define parlib_hist_end(name, begin) \
+	histogram_record_since(&parlib_##name##_hist, (begin))
+#else
+# define parlib_hist_begin() ((uint64_t)0)
+# define parlib_hist_end(name, begin) ((void)(begin))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARLIB_HISTOGRAM_H */
@@ -39,6 +39,8 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifndef __linux__
 #error "expecting __linux__ (for now, this library only runs on Linux)"
@@ -56,6 +58,18 @@ inline static void futex_wait(void *futex, int comparand)
 }
 
 
+/* Wait at most 'usec' microseconds for a wakeup.  Unlike futex_wait(), this
+ * returns after a single wakeup (or timeout), so callers must recheck their
+ * condition. */
+inline static void futex_timed_wait(void *futex, int comparand, uint64_t usec)
+{
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  syscall(SYS_futex, futex, FUTEX_WAIT, comparand, &ts, NULL, 0);
+}
+
+
 inline static void futex_wakeup_one(void *futex)
 {
   int r = syscall(SYS_futex, futex, FUTEX_WAKE, 1, NULL, NULL, 0);
@@ -1,6 +1,44 @@
 #ifndef PARLIB_TPOOL_H
 #define PARLIB_TPOOL_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+/* Defaults for the pool's limits, and how many jobs can wait for a thread
+ * before pooled_pthread_start() blocks (a power of 2). */
+#define POOLED_PTHREAD_MAX_THREADS 64
+#define POOLED_PTHREAD_IDLE_TIMEOUT 1000000  /* usec */
+#define POOLED_PTHREAD_QUEUE_SIZE 1024
+
+struct pthread_pool_stats {
+  /* Right now */
+  int max_threads;
+  int num_threads;
+  int num_idle;
+  size_t num_queued;
+  /* Since startup */
+  int peak_threads;
+  uint64_t threads_created;
+  uint64_t threads_reaped;
+  uint64_t jobs_queued;
+  uint64_t jobs_started;
+  uint64_t queue_full_waits;   /* calls that had to wait for room */
+  uint64_t extra_threads;      /* started past max_threads, queue being full */
+};
+
+/* Runs start_routine(arg) on a pool thread, in the order jobs were queued.
+ * Blocks while the queue is full, except when called from a pool thread or in
+ * vcore context: then the job gets a new thread straight away, even past
+ * max_threads.  A job that never returns keeps its thread for good, and counts
+ * against max_threads, so long-running services want a thread of their own. */
 void pooled_pthread_start(void *(*start_rountine)(void*), void *arg);
 
+/* At most 'max' pool threads run at once; other jobs wait in the queue. */
+void pooled_pthread_set_max_threads(int max);
+
+/* Pool threads that have had nothing to do for 'usec' exit. */
+void pooled_pthread_set_idle_timeout(uint64_t usec);
+
+void pooled_pthread_stats(struct pthread_pool_stats *stats);
+
 #endif
@@ -34,6 +34,7 @@ int __real_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
 #include "../uthread.h"
 #include "../event.h"
+#include "../histogram.h"
 #include "parlib.h"
 #include "futex.h"
 #include "pthread_pool.h"
@@ -56,7 +57,9 @@ typedef struct {
     return NULL; \
   } \
   arg.func = &do_##__func; \
+  uint64_t parked_at = parlib_hist_begin(); \
   uthread_yield(true, __uthread_yield_callback, &arg); \
+  parlib_hist_end(syscall_park, parked_at); \
   current_uthread->sysc_timeout = 0; \
   ret; \
 })
@@ -74,7 +77,9 @@ typedef struct {
   ret = __func_nonblock(__VA_ARGS__); \
   if ((ret == -1) && (errno == EWOULDBLOCK)) { \
     arg.func = &do_##__func; \
+    uint64_t parked_at = parlib_hist_begin(); \
     uthread_yield(true, __uthread_yield_callback, &arg); \
+    parlib_hist_end(syscall_park, parked_at); \
   } \
   current_uthread->sysc_timeout = 0; \
   ret; \
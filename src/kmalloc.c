@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2009 The Regents of the University of California
+ * Barret Rhoden <brho@cs.berkeley.edu>
+ * See LICENSE for details.
+ *
+ * General purpose memory allocator, built on size-class slab caches.  See
+ * kmalloc.h.
+ *
+ * Ported from the Akaros kernel's kmalloc. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "internal/parlib.h"
+#include "kmalloc.h"
+#include "atomic.h"
+
+static struct slab_cache *kmalloc_caches[KMALLOC_NR_CLASSES];
+static char kmalloc_names[KMALLOC_NR_CLASSES][16];
+
+/* The first four classes are 16 bytes apart.  From there on, each power of two
+ * (64 to 128, 128 to 256, ...) is split into four classes, a quarter of it
+ * apart. */
+static inline size_t __class_size(unsigned int idx)
+{
+	unsigned int shift;
+	if (idx < 4)
+		return (idx + 1) * 16;
+	shift = 6 + (idx - 4) / 4;
+	return (1UL << shift) + ((idx - 4) % 4 + 1) * (1UL << (shift - 2));
+}
+
+/* Index of the smallest class that fits 'size' bytes, tag included. */
+static inline unsigned int __class_index(size_t size)
+{
+	unsigned int shift;
+	if (size <= 64)
+		return size ? (size - 1) / 16 : 0;
+	shift = 63 - __builtin_clzl(size - 1);
+	return 4 + (shift - 6) * 4 + ((size - 1 - (1UL << shift)) >> (shift - 2));
+}
+
+static void kmalloc_init(void)
+{
+	for (int i = 0; i < KMALLOC_NR_CLASSES; i++) {
+		snprintf(kmalloc_names[i], sizeof(kmalloc_names[i]), "kmalloc_%zu",
+		         __class_size(i));
+		kmalloc_caches[i] = slab_cache_create(kmalloc_names[i], __class_size(i),
+		                                      KMALLOC_ALIGN, 0, NULL, NULL);
+	}
+	assert(__class_size(KMALLOC_NR_CLASSES - 1) == KMALLOC_MAX_CLASS);
+}
+
+static inline void *__tag_buf(struct kmalloc_tag *tag, uint32_t flags)
+{
+	tag->flags = flags;
+	tag->canary = KMALLOC_CANARY;
+	return tag + 1;
+}
+
+static inline struct kmalloc_tag *__buf_tag(void *buf)
+{
+	struct kmalloc_tag *tag = (struct kmalloc_tag*)buf - 1;
+	if (tag->canary != KMALLOC_CANARY) {
+		fprintf(stderr, "kmalloc: bad canary %08x for buf %p\n", tag->canary,
+		        buf);
+		abort();
+	}
+	return tag;
+}
+
+void *parlib_kmalloc(size_t size)
+{
+	struct kmalloc_tag *tag;
+	size_t ksize;
+
+	run_once(kmalloc_init());
+	ksize = size + sizeof(struct kmalloc_tag);
+	if (ksize < size)
+		return NULL;
+	if (ksize <= KMALLOC_MAX_CLASS) {
+		struct slab_cache *cache = kmalloc_caches[__class_index(ksize)];
+		tag = slab_cache_alloc(cache, 0);
+		tag->cache = cache;
+		return __tag_buf(tag, KMALLOC_TAG_CACHE);
+	}
+	ksize = ROUNDUP(ksize, PGSIZE);
+	if (ksize < size)
+		return NULL;
+	tag = mmap(0, ksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	           -1, 0);
+	if (tag == MAP_FAILED)
+		return NULL;
+	tag->size = ksize;
+	return __tag_buf(tag, KMALLOC_TAG_PAGES);
+}
+
+void *parlib_kzmalloc(size_t size)
+{
+	void *buf = parlib_kmalloc(size);
+	if (buf)
+		memset(buf, 0, size);
+	return buf;
+}
+
+/* Overallocates, and puts an UNALIGN tag right before the aligned address,
+ * pointing back at the real buffer.  Both are KMALLOC_ALIGN aligned, so if
+ * they differ at all, there is room for the tag. */
+void *parlib_kmalloc_align(size_t size, size_t align)
+{
+	void *buf, *aligned;
+	struct kmalloc_tag *tag;
+
+	assert(!(align & (align - 1)));
+	if (align <= KMALLOC_ALIGN)
+		return parlib_kmalloc(size);
+	if (size + align < size)
+		return NULL;
+	buf = parlib_kmalloc(size + align);
+	if (!buf)
+		return NULL;
+	aligned = ROUNDUP(buf, align);
+	if (aligned == buf)
+		return buf;
+	tag = (struct kmalloc_tag*)aligned - 1;
+	tag->offset = aligned - buf;
+	return __tag_buf(tag, KMALLOC_TAG_UNALIGN);
+}
+
+size_t parlib_kmalloc_usable_size(void *buf)
+{
+	struct kmalloc_tag *tag = __buf_tag(buf);
+
+	switch (tag->flags) {
+	case KMALLOC_TAG_CACHE:
+		return tag->cache->obj_size - sizeof(struct kmalloc_tag);
+	case KMALLOC_TAG_PAGES:
+		return tag->size - sizeof(struct kmalloc_tag);
+	case KMALLOC_TAG_UNALIGN:
+		return parlib_kmalloc_usable_size(buf - tag->offset) - tag->offset;
+	}
+	abort();
+}
+
+void *parlib_krealloc(void *buf, size_t size)
+{
+	void *new_buf;
+	size_t old_size;
+
+	if (!buf)
+		return parlib_kmalloc(size);
+	if (!size) {
+		parlib_kfree(buf);
+		return NULL;
+	}
+	old_size = parlib_kmalloc_usable_size(buf);
+	if (size <= old_size)
+		return buf;
+	new_buf = parlib_kmalloc(size);
+	if (!new_buf)
+		return NULL;
+	memcpy(new_buf, buf, old_size);
+	parlib_kfree(buf);
+	return new_buf;
+}
+
+void parlib_kfree(void *buf)
+{
+	struct kmalloc_tag *tag;
+
+	if (!buf)
+		return;
+	tag = __buf_tag(buf);
+	switch (tag->flags) {
+	case KMALLOC_TAG_CACHE:
+		slab_cache_free(tag->cache, tag);
+		return;
+	case KMALLOC_TAG_PAGES:
+		munmap(tag, tag->size);
+		return;
+	case KMALLOC_TAG_UNALIGN:
+		parlib_kfree(buf - tag->offset);
+		return;
+	}
+	fprintf(stderr, "kmalloc: bad tag flags %08x for buf %p\n", tag->flags,
+	        buf);
+	abort();
+}
+
+#undef parlib_kmalloc
+#undef parlib_kzmalloc
+#undef parlib_kmalloc_align
+#undef parlib_krealloc
+#undef parlib_kfree
+#undef parlib_kmalloc_usable_size
+EXPORT_ALIAS(INTERNAL(parlib_kmalloc), parlib_kmalloc)
+EXPORT_ALIAS(INTERNAL(parlib_kzmalloc), parlib_kzmalloc)
+EXPORT_ALIAS(INTERNAL(parlib_kmalloc_align), parlib_kmalloc_align)
+EXPORT_ALIAS(INTERNAL(parlib_krealloc), parlib_krealloc)
+EXPORT_ALIAS(INTERNAL(parlib_kfree), parlib_kfree)
+EXPORT_ALIAS(INTERNAL(parlib_kmalloc_usable_size), parlib_kmalloc_usable_size)
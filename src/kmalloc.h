@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009 The Regents of the University of California
+ * Barret Rhoden <brho@cs.berkeley.edu>
+ * See LICENSE for details.
+ *
+ * General purpose memory allocator, built on size-class slab caches.
+ *
+ * Requests up to KMALLOC_MAX_CLASS bytes come out of one of KMALLOC_NR_CLASSES
+ * slab caches.  The classes are spaced 16 bytes apart up to 64 bytes, and four
+ * to a power of two above that (64, 80, 96, 112, 128, 160, ...), so no more
+ * than 25% of a buffer is ever wasted on rounding up.  Since slab caches keep
+ * per-vcore magazines, most allocations and frees never take a lock or touch
+ * another vcore's cache lines, no matter which vcore a uthread last ran on.
+ * Larger requests are mmapped directly.
+ *
+ * Every buffer is preceded by a kmalloc_tag saying where it came from, so
+ * parlib_kfree() doesn't need to be told the size.  Buffers are aligned to
+ * KMALLOC_ALIGN, or more with parlib_kmalloc_align().
+ *
+ * Ported from the Akaros kernel's kmalloc. */
+
+#ifndef PARLIB_KMALLOC_H
+#define PARLIB_KMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "slab.h"
+#include "export.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KMALLOC_ALIGN 16
+#define KMALLOC_MAX_CLASS (32 * 1024)
+#define KMALLOC_NR_CLASSES 40
+
+/* Tag flags */
+#define KMALLOC_TAG_CACHE 1   /* came from a size-class slab cache */
+#define KMALLOC_TAG_PAGES 2   /* mmapped directly */
+#define KMALLOC_TAG_UNALIGN 3 /* offset into a buffer, for extra alignment */
+#define KMALLOC_CANARY 0xdeadbabe
+
+struct kmalloc_tag {
+	union {
+		struct slab_cache *cache; /* KMALLOC_TAG_CACHE */
+		size_t size;              /* KMALLOC_TAG_PAGES: of the mapping */
+		size_t offset;            /* KMALLOC_TAG_UNALIGN: from the real buffer */
+	};
+	uint32_t flags;
+	uint32_t canary;
+} __attribute__((aligned(KMALLOC_ALIGN)));
+
+#ifdef COMPILING_PARLIB
+# define parlib_kmalloc INTERNAL(parlib_kmalloc)
+# define parlib_kzmalloc INTERNAL(parlib_kzmalloc)
+# define parlib_kmalloc_align INTERNAL(parlib_kmalloc_align)
+# define parlib_krealloc INTERNAL(parlib_krealloc)
+# define parlib_kfree INTERNAL(parlib_kfree)
+# define parlib_kmalloc_usable_size INTERNAL(parlib_kmalloc_usable_size)
+#endif
+
+/* Like malloc().  Returns NULL only if mmapping a large request fails. */
+void *parlib_kmalloc(size_t size);
+/* Same, but zeroes the buffer. */
+void *parlib_kzmalloc(size_t size);
+/* Returns a buffer aligned to 'align', which must be a power of 2. */
+void *parlib_kmalloc_align(size_t size, size_t align);
+/* Grows or shrinks a buffer, like realloc().  Extra alignment from
+ * parlib_kmalloc_align() is not preserved. */
+void *parlib_krealloc(void *buf, size_t size);
+/* Frees a buffer from any of the above.  Freeing NULL does nothing. */
+void parlib_kfree(void *buf);
+/* How many bytes of the buffer may be used, which is at least what was asked
+ * for. */
+size_t parlib_kmalloc_usable_size(void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARLIB_KMALLOC_H */
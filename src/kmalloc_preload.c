@@ -0,0 +1,95 @@
+/* See COPYING.LESSER for copyright information. */
+
+/* Replaces the C library's malloc family with parlib_kmalloc(), for the whole
+ * application.  Build this into its own library and run with
+ *
+ *   LD_PRELOAD=libparlib_malloc.so ./app
+ *
+ * glibc calls through these symbols for its own allocations as well, so every
+ * buffer the application frees was handed out by kmalloc. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "kmalloc.h"
+#include "export.h"
+
+void EXPORT_SYMBOL *malloc(size_t size)
+{
+	void *buf = parlib_kmalloc(size);
+	if (!buf)
+		errno = ENOMEM;
+	return buf;
+}
+
+void EXPORT_SYMBOL free(void *buf)
+{
+	parlib_kfree(buf);
+}
+
+void EXPORT_SYMBOL *calloc(size_t nmemb, size_t size)
+{
+	void *buf;
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	buf = parlib_kzmalloc(nmemb * size);
+	if (!buf)
+		errno = ENOMEM;
+	return buf;
+}
+
+void EXPORT_SYMBOL *realloc(void *buf, size_t size)
+{
+	void *new_buf = parlib_krealloc(buf, size);
+	if (!new_buf && size)
+		errno = ENOMEM;
+	return new_buf;
+}
+
+void EXPORT_SYMBOL *memalign(size_t align, size_t size)
+{
+	void *buf;
+	if (!align || (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	buf = parlib_kmalloc_align(size, align);
+	if (!buf)
+		errno = ENOMEM;
+	return buf;
+}
+
+void EXPORT_SYMBOL *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int EXPORT_SYMBOL posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *buf;
+	if (!align || (align & (align - 1)) || align % sizeof(void*))
+		return EINVAL;
+	buf = parlib_kmalloc_align(size, align);
+	if (!buf)
+		return ENOMEM;
+	*memptr = buf;
+	return 0;
+}
+
+void EXPORT_SYMBOL *valloc(size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+void EXPORT_SYMBOL *pvalloc(size_t size)
+{
+	size_t pgsize = getpagesize();
+	return memalign(pgsize, (size + pgsize - 1) & ~(pgsize - 1));
+}
+
+size_t EXPORT_SYMBOL malloc_usable_size(void *buf)
+{
+	return buf ? parlib_kmalloc_usable_size(buf) : 0;
+}
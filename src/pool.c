@@ -19,6 +19,8 @@
 
 #include "internal/parlib.h"
 #include "pool.h"
+#include "uthread.h"
+#include "atomic.h"
 #include "export.h"
 #include <stddef.h>
 
@@ -78,7 +80,7 @@ int EXPORT_SYMBOL pool_free(pool_t* pool, void *object)
     return -1;
   }
   else {
-    uint16_t emptyIndex = (pool->index + pool->free);
+    size_t emptyIndex = (pool->index + pool->free);
     if (emptyIndex >= pool->num_objects) {
       emptyIndex -= pool->num_objects;
     }
@@ -88,3 +90,219 @@ int EXPORT_SYMBOL pool_free(pool_t* pool, void *object)
   }
 }
 
+
+size_t EXPORT_SYMBOL pool_alloc_n(pool_t *pool, void **objects, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n && pool->free; i++)
+    objects[i] = pool_alloc(pool);
+  return i;
+}
+
+size_t EXPORT_SYMBOL pool_free_n(pool_t *pool, void **objects, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (pool_free(pool, objects[i]))
+      break;
+  return i;
+}
+
+/* The ring.  Each slot's seq says whose turn it is: a producer at position
+ * pos may fill the slot once seq == pos, and a consumer may empty it once
+ * seq == pos + 1.  Whoever wins the CAS on head or tail owns the slot until
+ * it bumps seq for the next one around.  A slot that isn't ready yet either
+ * means the ring is full (or empty), or that whoever owns the slot from the
+ * last time around hasn't bumped seq yet, in which case we wait for it. */
+static bool __ring_push(cpool_t *pool, void *object)
+{
+  struct cpool_slot *slot;
+  size_t pos = pool->tail, old;
+  intptr_t diff;
+
+  while (1) {
+    slot = &pool->ring[pos % pool->num_objects];
+    diff = (intptr_t)slot->seq - (intptr_t)pos;
+    if (diff == 0) {
+      old = __sync_val_compare_and_swap(&pool->tail, pos, pos + 1);
+      if (old == pos)
+        break;
+      pos = old;
+    } else if (diff < 0) {
+      if ((intptr_t)(pos - pool->head) >= (intptr_t)pool->num_objects)
+        return false; /* full */
+      cpu_relax();
+      pos = pool->tail;
+    } else {
+      pos = pool->tail;
+    }
+  }
+  slot->object = object;
+  wmb();
+  slot->seq = pos + 1;
+  return true;
+}
+
+static void *__ring_pop(cpool_t *pool)
+{
+  struct cpool_slot *slot;
+  size_t pos = pool->head, old;
+  intptr_t diff;
+  void *object;
+
+  while (1) {
+    slot = &pool->ring[pos % pool->num_objects];
+    diff = (intptr_t)slot->seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      old = __sync_val_compare_and_swap(&pool->head, pos, pos + 1);
+      if (old == pos)
+        break;
+      pos = old;
+    } else if (diff < 0) {
+      if (pos == pool->tail)
+        return NULL; /* empty */
+      cpu_relax();
+      pos = pool->head;
+    } else {
+      pos = pool->head;
+    }
+  }
+  object = slot->object;
+  rwmb();
+  slot->seq = pos + pool->num_objects;
+  return object;
+}
+
+static size_t __ring_pop_n(cpool_t *pool, void **objects, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (!(objects[i] = __ring_pop(pool)))
+      break;
+  return i;
+}
+
+static size_t __ring_push_n(cpool_t *pool, void **objects, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (!__ring_push(pool, objects[i]))
+      break;
+  return i;
+}
+
+/* Per-vcore caches may only be touched while we can't be moved to another
+ * vcore.  Returns NULL if we aren't running on a vcore at all. */
+static inline struct cpool_cache *__cpool_cache_get(cpool_t *pool)
+{
+  if (vcore_id() < 0)
+    return NULL;
+  if (!in_vcore_context() && current_uthread)
+    uth_disable_notifs();
+  return &pool->caches[vcore_id()];
+}
+
+static inline void __cpool_cache_put(struct cpool_cache *cache)
+{
+  if (!in_vcore_context() && current_uthread)
+    uth_enable_notifs();
+}
+
+void EXPORT_SYMBOL cpool_init(cpool_t *pool, void *buffer,
+                              struct cpool_slot *ring, size_t num_objects,
+                              size_t object_size)
+{
+  assert(pool);
+  assert(buffer);
+  assert(ring);
+  assert(num_objects > 0);
+  assert(object_size > 0);
+
+  pool->buffer = buffer;
+  pool->num_objects = num_objects;
+  pool->object_size = object_size;
+  pool->ring = ring;
+  /* Start out with every object pushed into the ring */
+  for (size_t i = 0; i < num_objects; i++) {
+    ring[i].seq = i + 1;
+    ring[i].object = buffer + object_size * i;
+  }
+  pool->head = 0;
+  pool->tail = num_objects;
+  for (int i = 0; i < MAX_VCORES; i++)
+    pool->caches[i].count = 0;
+}
+
+size_t EXPORT_SYMBOL cpool_size(cpool_t *pool)
+{
+  return pool->num_objects;
+}
+
+size_t EXPORT_SYMBOL cpool_available(cpool_t *pool)
+{
+  size_t head = pool->head, tail = pool->tail;
+  size_t available = tail > head ? tail - head : 0;
+  for (int i = 0; i < MAX_VCORES; i++)
+    available += pool->caches[i].count;
+  return available;
+}
+
+size_t EXPORT_SYMBOL cpool_alloc_n(cpool_t *pool, void **objects, size_t n)
+{
+  struct cpool_cache *cache = __cpool_cache_get(pool);
+  size_t got = 0;
+
+  if (!cache)
+    return __ring_pop_n(pool, objects, n);
+  while (got < n) {
+    if (!cache->count) {
+      /* Big requests skip the cache */
+      if (n - got >= CPOOL_BATCH) {
+        got += __ring_pop_n(pool, objects + got, n - got);
+        break;
+      }
+      cache->count = __ring_pop_n(pool, cache->objects, CPOOL_BATCH);
+      if (!cache->count)
+        break;
+    }
+    while (got < n && cache->count)
+      objects[got++] = cache->objects[--cache->count];
+  }
+  __cpool_cache_put(cache);
+  return got;
+}
+
+size_t EXPORT_SYMBOL cpool_free_n(cpool_t *pool, void **objects, size_t n)
+{
+  struct cpool_cache *cache = __cpool_cache_get(pool);
+  size_t done = 0, pushed;
+
+  if (!cache)
+    return __ring_push_n(pool, objects, n);
+  while (done < n) {
+    if (cache->count == CPOOL_CACHE_SIZE) {
+      /* Send the oldest half back to the ring */
+      pushed = __ring_push_n(pool, cache->objects, CPOOL_BATCH);
+      if (!pushed)
+        break;
+      cache->count -= pushed;
+      memmove(cache->objects, cache->objects + pushed,
+              cache->count * sizeof(void*));
+    }
+    while (done < n && cache->count < CPOOL_CACHE_SIZE)
+      cache->objects[cache->count++] = objects[done++];
+  }
+  __cpool_cache_put(cache);
+  return done;
+}
+
+void EXPORT_SYMBOL *cpool_alloc(cpool_t *pool)
+{
+  void *object;
+  return cpool_alloc_n(pool, &object, 1) ? object : NULL;
+}
+
+int EXPORT_SYMBOL cpool_free(cpool_t *pool, void *object)
+{
+  return cpool_free_n(pool, &object, 1) ? 0 : -1;
+}
@@ -4,9 +4,14 @@
  * Kevin Klues <klueska@cs.berkeley.edu>
  */
 
+#ifndef PARLIB_POOL_H
+#define PARLIB_POOL_H
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include "common.h"
+#include "vcore.h"
 
 /* Metadata needed to manage a pool */
 typedef struct pool {
@@ -14,8 +19,8 @@ typedef struct pool {
   void **object_queue;
   size_t num_objects;
   size_t object_size;
-  unsigned int free;
-  unsigned int index;
+  size_t free;
+  size_t index;
 } pool_t;
 
 /* Initialize a pool.  All memory MUST be allocated externally.  The pool
@@ -25,7 +30,7 @@ typedef struct pool {
 void pool_init(pool_t *pool, void* buffer, void **object_queue,
                size_t num_objects, size_t object_size);
 
-/* Check how many objects the pool is able to hold */ 
+/* Check how many objects the pool is able to hold */
 size_t pool_size(pool_t *pool);
 
 /* See how many objects are currently available for allocation from the pool. */
@@ -37,3 +42,54 @@ void* pool_alloc(pool_t *pool);
 /* Put an object into the pool */
 int pool_free(pool_t* pool, void *object);
 
+/* Get/put up to n objects at once.  Return how many were moved, which is less
+ * than n only if the pool ran empty (or full). */
+size_t pool_alloc_n(pool_t *pool, void **objects, size_t n);
+size_t pool_free_n(pool_t *pool, void **objects, size_t n);
+
+/* A thread-safe pool.  Free objects live in a bounded ring shared by everyone,
+ * updated with a CAS per object and no locks (Dmitry Vyukov's MPMC queue),
+ * with a small cache in front of it for each vcore.  Vcores allocate and free
+ * from their own cache, and only go to the ring, CPOOL_BATCH objects at a
+ * time, once it runs empty or full.  Callers that aren't running on a vcore
+ * use the ring directly.
+ *
+ * Like pool_t, all memory is allocated externally: the objects' buffer, the
+ * ring (num_objects slots), and the cpool_t itself, per-vcore caches
+ * included.  Objects sitting in other vcores' caches can't be allocated, so a
+ * pool may look empty while a few objects per vcore are still free. */
+#define CPOOL_CACHE_SIZE 32
+#define CPOOL_BATCH (CPOOL_CACHE_SIZE / 2)
+
+struct cpool_slot {
+  volatile size_t seq;
+  void *object;
+};
+
+struct cpool_cache {
+  size_t count;
+  void *objects[CPOOL_CACHE_SIZE];
+} CACHE_LINE_ALIGNED;
+
+typedef struct cpool {
+  void *buffer;
+  size_t num_objects;
+  size_t object_size;
+  struct cpool_slot *ring;
+  volatile size_t head CACHE_LINE_ALIGNED;  /* next slot to allocate from */
+  volatile size_t tail CACHE_LINE_ALIGNED;  /* next slot to free into */
+  struct cpool_cache caches[MAX_VCORES];
+} cpool_t;
+
+/* Same as for pool_t.  The ring must have room for num_objects slots. */
+void cpool_init(cpool_t *pool, void *buffer, struct cpool_slot *ring,
+                size_t num_objects, size_t object_size);
+size_t cpool_size(cpool_t *pool);
+/* Approximate while others are using the pool */
+size_t cpool_available(cpool_t *pool);
+void *cpool_alloc(cpool_t *pool);
+int cpool_free(cpool_t *pool, void *object);
+size_t cpool_alloc_n(cpool_t *pool, void **objects, size_t n);
+size_t cpool_free_n(cpool_t *pool, void **objects, size_t n);
+
+#endif /* PARLIB_POOL_H */
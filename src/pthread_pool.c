@@ -1,27 +1,55 @@
 #include "internal/parlib.h"
 #include "internal/pthread_pool.h"
 #include "internal/futex.h"
-#include "slab.h"
-#include "spinlock.h"
+#include "arch.h"
+#include "atomic.h"
+#include "common.h"
+#include "timing.h"
+#include "vcore.h"
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
-#include <sys/queue.h>
 
-struct job {
-  SIMPLEQ_ENTRY(job) link;
+/* Jobs wait in a bounded ring, oldest first, updated with a CAS per job and
+ * no locks (Dmitry Vyukov's MPMC queue, as in pool.c's cpool).  A job is
+ * started by an idle pool thread if there is one, or else by a new thread, up
+ * to max_threads of them.  Past that, jobs queue up, and once the ring is full
+ * pooled_pthread_start() waits for room.  Pool threads and vcores can't wait:
+ * if every pool thread were stuck submitting, nobody would ever make room.
+ * They get an extra thread for the job instead, past max_threads.  Threads
+ * that find nothing to do for idle_timeout usec exit. */
+struct job_cell {
+  volatile size_t seq;
   void *(*func)(void*);
   void *arg;
 };
-SIMPLEQ_HEAD(job_queue, job);
-static struct job_queue job_queue = SIMPLEQ_HEAD_INITIALIZER(job_queue);
-static spinlock_t lock = SPINLOCK_INITIALIZER;
 
-static struct slab_cache *job_slab;
+static struct job_cell job_ring[POOLED_PTHREAD_QUEUE_SIZE];
+static volatile size_t job_head CACHE_LINE_ALIGNED;  /* next job to run */
+static volatile size_t job_tail CACHE_LINE_ALIGNED;  /* next free cell */
+
 static pthread_attr_t attr;
-static int num_avail = 0;
-static int num_enqueued = 0;
-static int total_enqueued = 0;
+static int max_threads = POOLED_PTHREAD_MAX_THREADS;
+static uint64_t idle_timeout = POOLED_PTHREAD_IDLE_TIMEOUT;
+
+static volatile int num_threads = 0;
+static volatile int num_idle = 0;
+/* Bumped for every job queued, and waited on by idle threads */
+static volatile int job_seq = 0;
+/* Bumped for every job dequeued while someone is waiting for room */
+static volatile int space_seq = 0;
+static volatile int num_space_waiters = 0;
+
+static struct pthread_pool_stats stats;
+
+static __thread bool __in_pool_thread = false;
+
+/* The job an extra thread starts with */
+struct first_job {
+  void *(*func)(void*);
+  void *arg;
+};
 
 static void __attribute__((constructor)) pthread_pool_init()
 {
@@ -29,68 +57,216 @@ static void __attribute__((constructor)) pthread_pool_init()
   pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-  job_slab = slab_cache_create("job_slab",
-    sizeof(struct job), __alignof__(struct job), 0, NULL, NULL);
+  for (size_t i = 0; i < POOLED_PTHREAD_QUEUE_SIZE; i++)
+    job_ring[i].seq = i;
+}
+
+static bool __enqueue_job(void *(*func)(void*), void *arg)
+{
+  size_t pos = job_tail;
+  struct job_cell *cell;
+
+  while (1) {
+    cell = &job_ring[pos % POOLED_PTHREAD_QUEUE_SIZE];
+    intptr_t dif = (intptr_t)(cell->seq - pos);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&job_tail, pos, pos + 1))
+        break;
+      pos = job_tail;
+    } else if (dif < 0) {
+      /* Full, or the last job in this cell isn't out yet */
+      return false;
+    } else {
+      pos = job_tail;
+    }
+  }
+  cell->func = func;
+  cell->arg = arg;
+  wmb();
+  cell->seq = pos + 1;
+  return true;
+}
+
+static bool __dequeue_job(void *(**func)(void*), void **arg)
+{
+  size_t pos = job_head;
+  struct job_cell *cell;
+
+  while (1) {
+    cell = &job_ring[pos % POOLED_PTHREAD_QUEUE_SIZE];
+    intptr_t dif = (intptr_t)(cell->seq - (pos + 1));
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&job_head, pos, pos + 1))
+        break;
+      pos = job_head;
+    } else if (dif < 0) {
+      /* Empty, or the next job isn't in yet.  Whoever is putting it there
+       * bumps job_seq when done, so waiting on that is safe. */
+      return false;
+    } else {
+      pos = job_head;
+    }
+  }
+  *func = cell->func;
+  *arg = cell->arg;
+  rmb();
+  cell->seq = pos + POOLED_PTHREAD_QUEUE_SIZE;
+  return true;
+}
+
+static inline bool __jobs_queued()
+{
+  return job_head != job_tail;
+}
+
+static void *__thread_wrapper(void *arg);
+
+/* Starts a pool thread we have already counted in num_threads */
+static bool __spawn(struct first_job *first)
+{
+  pthread_t handle;
+  int n;
+
+  if (pthread_create(&handle, &attr, __thread_wrapper, first)) {
+    __sync_fetch_and_add(&num_threads, -1);
+    return false;
+  }
+  __sync_fetch_and_add(&stats.threads_created, 1);
+  while ((n = stats.peak_threads) < num_threads)
+    __sync_bool_compare_and_swap(&stats.peak_threads, n, num_threads);
+  return true;
 }
 
-static struct job *__dequeue_job(struct job_queue *q)
+/* Starts another pool thread, unless we're at max_threads */
+static void __maybe_spawn()
 {
-  struct job *j = SIMPLEQ_FIRST(q);
-  if (j) {
-    SIMPLEQ_REMOVE_HEAD(q, link);
-    num_enqueued--;
+  int n = num_threads;
+  while (n < max_threads) {
+    if (__sync_bool_compare_and_swap(&num_threads, n, n + 1)) {
+      __spawn(NULL);
+      return;
+    }
+    n = num_threads;
   }
-  return j;
+}
+
+/* Runs a job on a thread of its own, whatever max_threads says.  Once done
+ * with it, the thread carries on as a normal pool thread. */
+static void __spawn_extra(void *(*func)(void*), void *arg)
+{
+  struct first_job *first = parlib_malloc(sizeof(struct first_job));
+
+  first->func = func;
+  first->arg = arg;
+  __sync_fetch_and_add(&num_threads, 1);
+  if (!__spawn(first))
+    abort();
+  __sync_fetch_and_add(&stats.extra_threads, 1);
+}
+
+/* Makes sure some thread will get to the jobs that are queued */
+static void __kick()
+{
+  if (num_idle > 0)
+    futex_wakeup_one((int*)&job_seq);
+  else
+    __maybe_spawn();
 }
 
 static void *__thread_wrapper(void *arg)
 {
-  int prev_total_enqueued = 0;
-  struct job_queue *q = (struct job_queue*)arg;
-  struct job job, *jobp = NULL;
-
-  while(1) {
-    spinlock_lock(&lock);
-      if (jobp != NULL)
-        num_avail++;
-
-      if ((jobp = __dequeue_job(q)) == NULL)
-        prev_total_enqueued = total_enqueued;
-      else {
-        job = *jobp;
-        slab_cache_free(job_slab, jobp);
-        num_avail--;
-      }
-    spinlock_unlock(&lock);
+  struct first_job *first = arg;
+  void *(*func)(void*);
+  uint64_t idle_since = 0;
 
-    if (jobp)
-      job.func(job.arg);
-    else
-      futex_wait(&total_enqueued, prev_total_enqueued);
+  __in_pool_thread = true;
+  if (first) {
+    func = first->func;
+    arg = first->arg;
+    free(first);
+    __sync_fetch_and_add(&stats.jobs_started, 1);
+    func(arg);
   }
 
-  return 0;
+  while (1) {
+    int seq = job_seq;
+
+    if (__dequeue_job(&func, &arg)) {
+      /* Our cell must look free before we check for waiters */
+      mb();
+      if (num_space_waiters) {
+        __sync_fetch_and_add(&space_seq, 1);
+        futex_wakeup_one((int*)&space_seq);
+      }
+      if (__jobs_queued())
+        __kick();
+      __sync_fetch_and_add(&stats.jobs_started, 1);
+      func(arg);
+      idle_since = 0;
+      continue;
+    }
+
+    if (idle_since == 0) {
+      idle_since = read_tsc();
+    } else if (tsc2usec(read_tsc() - idle_since) >= idle_timeout) {
+      /* Leave, unless a job showed up that nobody else may see to.
+       * Submitters queue before looking at num_threads, and we drop out of
+       * num_threads before looking at the queue, so one of us notices. */
+      __sync_fetch_and_add(&num_threads, -1);
+      if (!__jobs_queued()) {
+        __sync_fetch_and_add(&stats.threads_reaped, 1);
+        return NULL;
+      }
+      __sync_fetch_and_add(&num_threads, 1);
+      continue;
+    }
+
+    __sync_fetch_and_add(&num_idle, 1);
+    futex_timed_wait((int*)&job_seq, seq, idle_timeout);
+    __sync_fetch_and_add(&num_idle, -1);
+  }
 }
 
 void EXPORT_SYMBOL pooled_pthread_start(void *(*func)(void*), void *arg)
 {
-  spinlock_lock(&lock);
-    struct job *j = slab_cache_alloc(job_slab, 0);
-    assert(j);
-    j->func = func;
-    j->arg = arg;
-
-    SIMPLEQ_INSERT_HEAD(&job_queue, j, link);
-    num_enqueued++;
-    total_enqueued++;
-
-    if (num_avail < num_enqueued) {
-      assert(num_avail == num_enqueued-1);
-      pthread_t handle;
-      pthread_create(&handle, &attr, __thread_wrapper, &job_queue);
-      num_avail++;
+  if (!__enqueue_job(func, arg)) {
+    if (__in_pool_thread || in_vcore_context()) {
+      __spawn_extra(func, arg);
+      return;
+    }
+    __sync_fetch_and_add(&stats.queue_full_waits, 1);
+    __sync_fetch_and_add(&num_space_waiters, 1);
+    while (1) {
+      int seq = space_seq;
+      if (__enqueue_job(func, arg))
+        break;
+      futex_wait((int*)&space_seq, seq);
     }
-  spinlock_unlock(&lock);
+    __sync_fetch_and_add(&num_space_waiters, -1);
+  }
+  __sync_fetch_and_add(&stats.jobs_queued, 1);
+  __sync_fetch_and_add(&job_seq, 1);
+  __kick();
+}
+
+void EXPORT_SYMBOL pooled_pthread_set_max_threads(int max)
+{
+  assert(max > 0);
+  max_threads = max;
+}
+
+void EXPORT_SYMBOL pooled_pthread_set_idle_timeout(uint64_t usec)
+{
+  idle_timeout = usec;
+}
+
+void EXPORT_SYMBOL pooled_pthread_stats(struct pthread_pool_stats *s)
+{
+  size_t head = job_head;
 
-  futex_wakeup_one(&total_enqueued);
+  *s = stats;
+  s->max_threads = max_threads;
+  s->num_threads = num_threads;
+  s->num_idle = num_idle;
+  s->num_queued = job_tail - head;
 }
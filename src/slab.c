@@ -6,15 +6,23 @@
  *
  * Slab allocator, based on the SunOS 5.4 allocator paper.
  *
- * Note that we don't have a hash table for buf to bufctl for the large buffer
- * objects, so we use the same style for small objects: store the pointer to the
- * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
+ * Allocated large objects are tracked in a per-cache hash table from buffer
+ * address to bufctl, so we never have to write anything into (or next to) the
+ * objects themselves.
  *
  * Ported directly from the Akaros kernel's slab allocator. */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "internal/parlib.h"
 #include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include "slab.h"
 
 struct slab_cache_list slab_caches;
@@ -23,10 +31,47 @@ spin_pdr_lock_t slab_caches_lock;
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void slab_cache_grow(struct slab_cache *cp);
+static void __mag_purge(struct slab_cache *cp, struct slab_magazine *mag);
+static void __depot_purge(struct slab_cache *cp);
+
+/* The allocator's own metadata comes straight from libc, rather than through
+ * malloc, so that slab caches can back malloc itself (see kmalloc.h) without
+ * recursing into themselves. */
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *__meta_alloc(size_t align, size_t size)
+{
+	void *p = __libc_memalign(align, size);
+	if (p == NULL)
+		abort();
+	return p;
+}
+
+static void __meta_free(void *p)
+{
+	__libc_free(p);
+}
+
+/* The cache lock, counting how often it was already taken */
+static inline void __cache_lock(struct slab_cache *cp)
+{
+	if (!in_vcore_context() && current_uthread)
+		uth_disable_notifs();
+	if (spinlock_trylock((spinlock_t*)&cp->cache_lock)) {
+		spinlock_lock((spinlock_t*)&cp->cache_lock);
+		cp->lock_contended++;
+	}
+}
+
+static inline void __cache_unlock(struct slab_cache *cp)
+{
+	spin_pdr_unlock(&cp->cache_lock);
+}
 
 /* Cache of the slab_cache objects, needed for bootstrapping */
 struct slab_cache slab_cache_cache;
-struct slab_cache *slab_cache, *slab_bufctl_cache;
+struct slab_cache *slab_bufctl_cache;
 
 static void __slab_cache_create(struct slab_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -38,14 +83,45 @@ static void __slab_cache_create(struct slab_cache *kc, const char *name,
 	spin_pdr_init(&kc->cache_lock);
 	kc->name = name;
 	kc->obj_size = obj_size;
+	/* Free small objects point to the next free one.  Without a constructor
+	 * there is no state to preserve in a free object, so the pointer can live
+	 * in the object itself.  Otherwise it goes right after the object. */
+	kc->free_ptr_offset = ctor ? obj_size : 0;
 	kc->align = align;
 	kc->flags = flags;
 	TAILQ_INIT(&kc->full_slab_list);
 	TAILQ_INIT(&kc->partial_slab_list);
 	TAILQ_INIT(&kc->empty_slab_list);
+	kc->nr_empty_slabs = 0;
+	kc->empty_min = 0;
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
+	TAILQ_INIT(&kc->chunks);
+	kc->chunk_size = SLAB_CHUNK_SIZE;
+	kc->slot_size = 0;
+	kc->slots_per_chunk = 0;
+	kc->colour_next = 0;
+	kc->bufctl_hash = NULL;
+	kc->bufctl_hash_bits = 0;
+	kc->vcore_caches = __meta_alloc(ARCH_CL_SIZE,
+	                       sizeof(struct slab_vcore_cache) * MAX_VCORES);
+	memset(kc->vcore_caches, 0, sizeof(struct slab_vcore_cache) * MAX_VCORES);
+	spin_pdr_init(&kc->depot_lock);
+	kc->depot_full = NULL;
+	kc->depot_empty = NULL;
+	kc->depot_nr_full = 0;
+	kc->depot_nr_empty = 0;
+	kc->depot_full_min = 0;
+	kc->depot_empty_min = 0;
+	kc->magsize = SLAB_MAG_INIT;
+	kc->depot_contention = 0;
+	kc->slab_allocs = 0;
+	kc->slab_frees = 0;
+	kc->nr_grows = 0;
+	kc->nr_reaps = 0;
+	kc->lock_contended = 0;
+	kc->depot_contended = 0;
 	
 	/* put in cache list based on it's size */
 	struct slab_cache *i, *prev = NULL;
@@ -73,9 +149,7 @@ void slab_cache_init(void)
 	__slab_cache_create(&slab_cache_cache, "slab_cache",
 	                    sizeof(struct slab_cache),
 	                    __alignof__(struct slab_cache), 0, NULL, NULL);
-	/* Build the slab and bufctl caches */
-	slab_cache = slab_cache_create("slab", sizeof(struct slab),
-	                       __alignof__(struct slab), 0, NULL, NULL); 
+	/* Build the bufctl cache */
 	slab_bufctl_cache = slab_cache_create("slab_bufctl",
 	                         sizeof(struct slab_bufctl),
 	                         __alignof__(struct slab_bufctl), 0, NULL, NULL); 
@@ -98,37 +172,158 @@ struct slab_cache *slab_cache_create(const char *name, size_t obj_size,
 	return kc;
 }
 
+void slab_cache_set_chunk_size(struct slab_cache *cp, size_t chunk_size)
+{
+	assert(chunk_size >= PGSIZE && !(chunk_size & (chunk_size - 1)));
+	__cache_lock(cp);
+	assert(TAILQ_EMPTY(&cp->chunks));
+	cp->chunk_size = chunk_size;
+	cp->slots_per_chunk = 0;
+	__cache_unlock(cp);
+}
+
+/* Chunks.  Each cache maps memory chunk_size bytes at a time, aligned to
+ * chunk_size, and carves it into equally sized slots: one page per slab for
+ * small objects, and enough pages for NUM_BUF_PER_SLAB objects for large ones.
+ * The struct slab of every slot lives in the chunk's header, so we can get
+ * from any address in a slab (or from its struct slab) to the chunk by
+ * rounding down, without a per-page lookup table.
+ *
+ * Grab the cache lock before calling any of these. */
+static inline size_t __chunk_hdr_size(size_t nr_slots)
+{
+	return ROUNDUP(sizeof(struct slab_chunk) + nr_slots * sizeof(struct slab),
+	               PGSIZE);
+}
+
+static void __chunk_geometry(struct slab_cache *cp)
+{
+	size_t n;
+	if (cp->obj_size <= SLAB_LARGE_CUTOFF)
+		cp->slot_size = PGSIZE;
+	else
+		cp->slot_size = ROUNDUP(NUM_BUF_PER_SLAB *
+		                        ROUNDUP(cp->obj_size, cp->align), PGSIZE);
+	/* Huge objects get chunks big enough for at least one slab */
+	while (__chunk_hdr_size(1) + cp->slot_size > cp->chunk_size)
+		cp->chunk_size *= 2;
+	n = cp->chunk_size / cp->slot_size;
+	while (__chunk_hdr_size(n) + n * cp->slot_size > cp->chunk_size)
+		n--;
+	cp->slots_per_chunk = n;
+}
+
+static inline struct slab_chunk *__chunk_of(struct slab_cache *cp, void *addr)
+{
+	return ROUNDDOWN(addr, cp->chunk_size);
+}
+
+static inline void *__slab_base(struct slab_cache *cp, struct slab *a_slab)
+{
+	struct slab_chunk *c = __chunk_of(cp, a_slab);
+	return c->slots + (a_slab - c->slabs) * cp->slot_size;
+}
+
+static inline struct slab *__buf2slab(struct slab_cache *cp, void *buf)
+{
+	struct slab_chunk *c = __chunk_of(cp, buf);
+	return &c->slabs[(buf - c->slots) / cp->slot_size];
+}
+
+static struct slab_chunk *__chunk_create(struct slab_cache *cp)
+{
+	size_t size = cp->chunk_size;
+	struct slab_chunk *c;
+	void *map;
+
+	/* Map twice the size, and trim it down to an aligned chunk.  We don't
+	 * populate it: slots get faulted in as they are carved out. */
+	map = mmap(0, 2 * size, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(map != MAP_FAILED);
+	c = ROUNDUP(map, size);
+	if ((void*)c != map)
+		munmap(map, (void*)c - map);
+	munmap((void*)c + size, map + size - (void*)c);
+#ifdef MADV_HUGEPAGE
+	if (cp->flags & SLAB_HUGEPAGE)
+		madvise(c, size, MADV_HUGEPAGE);
+#endif
+	c->slots = (void*)c + __chunk_hdr_size(cp->slots_per_chunk);
+	c->nr_free = cp->slots_per_chunk;
+	c->next_unused = 0;
+	TAILQ_INIT(&c->free_slabs);
+	TAILQ_INSERT_HEAD(&cp->chunks, c, link);
+	return c;
+}
+
+/* Hands out a free slot, returning its struct slab. */
+static struct slab *__slot_alloc(struct slab_cache *cp)
+{
+	struct slab_chunk *c;
+	struct slab *a_slab;
+
+	if (!cp->slots_per_chunk)
+		__chunk_geometry(cp);
+	c = TAILQ_FIRST(&cp->chunks);
+	if (!c || !c->nr_free)
+		c = __chunk_create(cp);
+	a_slab = TAILQ_FIRST(&c->free_slabs);
+	if (a_slab)
+		TAILQ_REMOVE(&c->free_slabs, a_slab, link);
+	else
+		a_slab = &c->slabs[c->next_unused++];
+	if (--c->nr_free == 0) {
+		TAILQ_REMOVE(&cp->chunks, c, link);
+		TAILQ_INSERT_TAIL(&cp->chunks, c, link);
+	}
+	return a_slab;
+}
+
+/* Returns a slot to its chunk, letting the OS reclaim its memory.  Unmaps the
+ * chunk once all of its slots are free. */
+static void __slot_free(struct slab_cache *cp, struct slab *a_slab)
+{
+	struct slab_chunk *c = __chunk_of(cp, a_slab);
+
+	TAILQ_REMOVE(&cp->chunks, c, link);
+	if (++c->nr_free == cp->slots_per_chunk) {
+		munmap(c, cp->chunk_size);
+		return;
+	}
+	/* MADV_FREE lets the kernel take the pages lazily, only under memory
+	 * pressure, and is much cheaper than DONTNEED if we reuse the slot first. */
+#ifdef MADV_FREE
+	if (madvise(__slab_base(cp, a_slab), cp->slot_size, MADV_FREE))
+#endif
+		madvise(__slab_base(cp, a_slab), cp->slot_size, MADV_DONTNEED);
+	TAILQ_INSERT_HEAD(&c->free_slabs, a_slab, link);
+	TAILQ_INSERT_HEAD(&cp->chunks, c, link);
+}
+
 static void slab_destroy(struct slab_cache *cp, struct slab *a_slab)
 {
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		/* Deconstruct all the objects, if necessary */
 		if (cp->dtor) {
-			void *buf = a_slab->free_small_obj;
+			void *buf = __slab_base(cp, a_slab) + a_slab->colour;
 			for (int i = 0; i < a_slab->num_total_obj; i++) {
 				cp->dtor(buf, cp->obj_size);
 				buf += a_slab->obj_size;
 			}
 		}
-		munmap(ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
 	} else {
-		struct slab_bufctl *i;
-		void *page_start = (void*)-1;
-		// compute how many pages are allocated, given a power of two allocator
-		size_t num_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
-		                           PGSIZE;
-		TAILQ_FOREACH(i, &a_slab->bufctl_freelist, link) {
-			// Track the lowest buffer address, which is the start of the buffer
-			page_start = MIN(page_start, i->buf_addr);
+		struct slab_bufctl *i, *next;
+		for (i = TAILQ_FIRST(&a_slab->bufctl_freelist); i; i = next) {
+			next = TAILQ_NEXT(i, link);
 			/* Deconstruct all the objects, if necessary */
-			if (cp->dtor) // TODO: (BUF)
+			if (cp->dtor)
 				cp->dtor(i->buf_addr, cp->obj_size);
 			slab_cache_free(slab_bufctl_cache, i);
 		}
-		// free the pages for the slab's buffer
-		munmap(page_start, num_pgs * PGSIZE);
-		// free the slab object
-		slab_cache_free(slab_cache, a_slab);
 	}
+	__slot_free(cp, a_slab);
+	cp->nr_reaps++;
 }
 
 /* Once you call destroy, never use this cache again... o/w there may be weird
@@ -137,7 +332,22 @@ void slab_cache_destroy(struct slab_cache *cp)
 {
 	struct slab *a_slab, *next;
 
-	spin_pdr_lock(&cp->cache_lock);
+	/* Hide the cache from the reaper first.  It takes slab_caches_lock before
+	 * any cache's locks. */
+	spin_pdr_lock(&slab_caches_lock);
+	SLIST_REMOVE(&slab_caches, cp, slab_cache, link);
+	spin_pdr_unlock(&slab_caches_lock);
+
+	/* Nobody may use the cache anymore, so we can empty every vcore's
+	 * magazines from here. */
+	for (int i = 0; i < MAX_VCORES; i++) {
+		__mag_purge(cp, cp->vcore_caches[i].loaded);
+		__mag_purge(cp, cp->vcore_caches[i].prev);
+	}
+	__meta_free(cp->vcore_caches);
+	__depot_purge(cp);
+
+	__cache_lock(cp);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
 	/* Clean out the empty list.  We can't use a regular FOREACH here, since the
@@ -146,21 +356,94 @@ void slab_cache_destroy(struct slab_cache *cp)
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
+		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
 		slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
-	spin_pdr_lock(&slab_caches_lock);
-	SLIST_REMOVE(&slab_caches, cp, slab_cache, link);
-	spin_pdr_unlock(&slab_caches_lock);
+	cp->nr_empty_slabs = cp->empty_min = 0;
+	assert(TAILQ_EMPTY(&cp->chunks));
+	__meta_free(cp->bufctl_hash);
 	slab_cache_free(&slab_cache_cache, cp); 
-	spin_pdr_unlock(&cp->cache_lock);
+	__cache_unlock(cp);
 }
 
-/* Front end: clients of caches use these */
-void *slab_cache_alloc(struct slab_cache *cp, int flags)
+/* The bufctl hash table starts out with this many chains, and doubles whenever
+ * there are more allocated large objects than chains. */
+#define BUFCTL_HASH_INIT_BITS 6
+
+static inline size_t __bufctl_hash(struct slab_cache *cp, void *buf)
+{
+	/* Fibonacci hashing: the top bits of the product are well mixed, even
+	 * though all of our buffers are aligned the same way. */
+	return ((uint64_t)(uintptr_t)buf * 0x9e3779b97f4a7c15ULL) >>
+	       (64 - cp->bufctl_hash_bits);
+}
+
+static void __bufctl_hash_resize(struct slab_cache *cp, unsigned int bits)
+{
+	struct slab_bufctl **old_hash = cp->bufctl_hash;
+	size_t old_size = old_hash ? 1UL << cp->bufctl_hash_bits : 0;
+	struct slab_bufctl *i, *next;
+
+	cp->bufctl_hash = __meta_alloc(sizeof(void*),
+	                               sizeof(struct slab_bufctl*) << bits);
+	memset(cp->bufctl_hash, 0, sizeof(struct slab_bufctl*) << bits);
+	cp->bufctl_hash_bits = bits;
+	for (size_t b = 0; b < old_size; b++) {
+		for (i = old_hash[b]; i; i = next) {
+			next = i->hash_next;
+			size_t h = __bufctl_hash(cp, i->buf_addr);
+			i->hash_next = cp->bufctl_hash[h];
+			cp->bufctl_hash[h] = i;
+		}
+	}
+	__meta_free(old_hash);
+}
+
+/* Grab the cache lock before calling these.  nr_cur_alloc is the number of
+ * bufctls in the table. */
+static void __bufctl_hash_insert(struct slab_cache *cp,
+                                 struct slab_bufctl *a_bufctl)
+{
+	size_t h;
+	if (!cp->bufctl_hash)
+		__bufctl_hash_resize(cp, BUFCTL_HASH_INIT_BITS);
+	else if (cp->nr_cur_alloc >= 1UL << cp->bufctl_hash_bits)
+		__bufctl_hash_resize(cp, cp->bufctl_hash_bits + 1);
+	h = __bufctl_hash(cp, a_bufctl->buf_addr);
+	a_bufctl->hash_next = cp->bufctl_hash[h];
+	cp->bufctl_hash[h] = a_bufctl;
+}
+
+/* Finds and removes the bufctl of an allocated large object. */
+static struct slab_bufctl *buf2bufctl(struct slab_cache *cp, void *buf)
+{
+	struct slab_bufctl **pp = &cp->bufctl_hash[__bufctl_hash(cp, buf)];
+	struct slab_bufctl *a_bufctl;
+	for (a_bufctl = *pp; a_bufctl; pp = &a_bufctl->hash_next,
+	                                 a_bufctl = *pp) {
+		if (a_bufctl->buf_addr == buf) {
+			*pp = a_bufctl->hash_next;
+			return a_bufctl;
+		}
+	}
+	/* Freeing something this cache never handed out */
+	assert(0);
+	return NULL;
+}
+
+/* Decrements a counter, tracking the lowest value it reached. */
+static inline void __dec_min(unsigned long *count, unsigned long *min)
+{
+	if (--(*count) < *min)
+		*min = *count;
+}
+
+/* Slab layer: hands out objects straight from the slabs.  Grab the cache lock
+ * before calling these. */
+static void *__slab_alloc(struct slab_cache *cp)
 {
 	void *retval = NULL;
-	spin_pdr_lock(&cp->cache_lock);
 	// look at partial list
 	struct slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
 	// 	if none, go to empty list and get an empty and make it partial
@@ -171,6 +454,7 @@ void *slab_cache_alloc(struct slab_cache *cp, int flags)
 		// move to partial list
 		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
+		__dec_min(&cp->nr_empty_slabs, &cp->empty_min);
 		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
 	} 
 	// have a partial now (a_slab), get an item, return item
@@ -179,12 +463,13 @@ void *slab_cache_alloc(struct slab_cache *cp, int flags)
 		/* adding the size of the cache_obj to get to the pointer at end of the
 		 * buffer pointing to the next free_small_obj */
 		a_slab->free_small_obj = *(uintptr_t**)(a_slab->free_small_obj +
-		                                        cp->obj_size);
+		                                        cp->free_ptr_offset);
 	} else {
 		// rip the first bufctl out of the partial slab's buf list
 		struct slab_bufctl *a_bufctl = TAILQ_FIRST(&a_slab->bufctl_freelist);
 		TAILQ_REMOVE(&a_slab->bufctl_freelist, a_bufctl, link);
 		retval = a_bufctl->buf_addr;
+		__bufctl_hash_insert(cp, a_bufctl);
 	}
 	a_slab->num_busy_obj++;
 	// Check if we are full, if so, move to the full list
@@ -193,34 +478,24 @@ void *slab_cache_alloc(struct slab_cache *cp, int flags)
 		TAILQ_INSERT_HEAD(&cp->full_slab_list, a_slab, link);
 	}
 	cp->nr_cur_alloc++;
-	spin_pdr_unlock(&cp->cache_lock);
 	return retval;
 }
 
-static inline struct slab_bufctl *buf2bufctl(void *buf, size_t offset)
-{
-	// TODO: hash table for back reference (BUF)
-	return *((struct slab_bufctl**)(buf + offset));
-}
-
-void slab_cache_free(struct slab_cache *cp, void *buf)
+static void __slab_free(struct slab_cache *cp, void *buf)
 {
 	struct slab *a_slab;
 	struct slab_bufctl *a_bufctl;
 
-	spin_pdr_lock(&cp->cache_lock);
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		// find its slab
-		a_slab = (struct slab*)(ROUNDDOWN(buf, PGSIZE) + PGSIZE -
-		                             sizeof(struct slab));
+		a_slab = __buf2slab(cp, buf);
 		/* write location of next free small obj to the space at the end of the
 		 * buffer, then list buf as the next free small obj */
-		*(uintptr_t**)(buf + cp->obj_size) = a_slab->free_small_obj;
+		*(uintptr_t**)(buf + cp->free_ptr_offset) = a_slab->free_small_obj;
 		a_slab->free_small_obj = buf;
 	} else {
 		/* Give the bufctl back to the parent slab */
-		// TODO: (BUF) change the interface to not take an offset
-		a_bufctl = buf2bufctl(buf, cp->obj_size);
+		a_bufctl = buf2bufctl(cp, buf);
 		a_slab = a_bufctl->my_slab;
 		TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 	}
@@ -234,62 +509,308 @@ void slab_cache_free(struct slab_cache *cp, void *buf)
 		// if there are none, move to from partial to empty
 		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
 		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+		cp->nr_empty_slabs++;
 	}
-	spin_pdr_unlock(&cp->cache_lock);
+}
+
+/* Magazine layer (Bonwick and Adams, "Magazines and Vmem", 2001).
+ *
+ * Each vcore keeps two magazines (arrays of free, constructed objects) per
+ * cache, so most allocs and frees are a push or pop on vcore-local memory,
+ * with no locks and no shared cache lines.  Only once both magazines are empty
+ * (alloc) or full (free) does the vcore go to the cache's depot, which swaps
+ * its magazine for a full or empty one under the depot lock.  If the depot
+ * has no full magazines either, we fall back to the slab layer.
+ *
+ * Magazines start out SLAB_MAG_INIT rounds big.  Every SLAB_MAG_CONTENTION
+ * times a vcore finds the depot lock taken, the cache doubles the size of the
+ * magazines it hands out, up to SLAB_MAG_MAX, so that busy caches go to the
+ * depot less often.  Smaller empty magazines are freed as they come back. */
+static inline bool __mag_empty(struct slab_magazine *mag)
+{
+	return !mag || mag->rounds == 0;
+}
+
+static inline bool __mag_full(struct slab_magazine *mag)
+{
+	return !mag || mag->rounds == mag->size;
+}
+
+static inline unsigned long __mag_rounds(struct slab_magazine *mag)
+{
+	return mag ? mag->rounds : 0;
+}
+
+static inline void __mag_swap(struct slab_vcore_cache *vc)
+{
+	struct slab_magazine *temp = vc->loaded;
+	vc->loaded = vc->prev;
+	vc->prev = temp;
+}
+
+/* Per-vcore magazines may only be touched while we can't be moved to another
+ * vcore, i.e. in vcore context or with notifs disabled.  Returns NULL if we
+ * aren't running on a vcore at all (e.g. from a backing pthread). */
+static inline struct slab_vcore_cache *__vcore_cache_get(struct slab_cache *cp)
+{
+	if (vcore_id() < 0)
+		return NULL;
+	if (!in_vcore_context() && current_uthread)
+		uth_disable_notifs();
+	return &cp->vcore_caches[vcore_id()];
+}
+
+static inline void __vcore_cache_put(struct slab_vcore_cache *vc)
+{
+	if (!in_vcore_context() && current_uthread)
+		uth_enable_notifs();
+}
+
+/* Called with notifs disabled (see above), so we can use the raw spinlock and
+ * still notice when someone else holds it. */
+static void __depot_lock(struct slab_cache *cp)
+{
+	if (!spinlock_trylock((spinlock_t*)&cp->depot_lock))
+		return;
+	spinlock_lock((spinlock_t*)&cp->depot_lock);
+	cp->depot_contended++;
+	if (++cp->depot_contention == SLAB_MAG_CONTENTION) {
+		cp->depot_contention = 0;
+		cp->magsize = MIN(cp->magsize * 2, SLAB_MAG_MAX);
+	}
+}
+
+static void __depot_unlock(struct slab_cache *cp)
+{
+	spinlock_unlock((spinlock_t*)&cp->depot_lock);
+}
+
+static inline void __depot_push(struct slab_magazine **list,
+                                struct slab_magazine *mag)
+{
+	mag->next = *list;
+	*list = mag;
+}
+
+static inline struct slab_magazine *__depot_pop(struct slab_magazine **list)
+{
+	struct slab_magazine *mag = *list;
+	if (mag)
+		*list = mag->next;
+	return mag;
+}
+
+/* Trades the vcore's empty prev magazine for a full one from the depot, which
+ * becomes loaded.  Returns false if the depot has no full magazines. */
+static bool __depot_get_full(struct slab_cache *cp, struct slab_vcore_cache *vc)
+{
+	struct slab_magazine *mag;
+
+	__depot_lock(cp);
+	mag = __depot_pop(&cp->depot_full);
+	if (mag) {
+		__dec_min(&cp->depot_nr_full, &cp->depot_full_min);
+		if (vc->prev) {
+			__depot_push(&cp->depot_empty, vc->prev);
+			cp->depot_nr_empty++;
+		}
+		vc->prev = vc->loaded;
+		vc->loaded = mag;
+		vc->nr_cached = mag->rounds + __mag_rounds(vc->prev);
+	}
+	__depot_unlock(cp);
+	return mag != NULL;
+}
+
+/* Trades the vcore's full prev magazine for an empty one, which becomes
+ * loaded.  Allocates a new magazine if the depot has none of the current
+ * size. */
+static void __depot_get_empty(struct slab_cache *cp,
+                              struct slab_vcore_cache *vc)
+{
+	struct slab_magazine *mag, *stale = NULL;
+	int magsize;
+
+	__depot_lock(cp);
+	mag = __depot_pop(&cp->depot_empty);
+	if (mag)
+		__dec_min(&cp->depot_nr_empty, &cp->depot_empty_min);
+	magsize = cp->magsize;
+	__depot_unlock(cp);
+
+	if (mag && mag->size < magsize) {
+		stale = mag;
+		mag = NULL;
+	}
+	if (!mag) {
+		mag = __meta_alloc(sizeof(void*), sizeof(struct slab_magazine) +
+		                                  magsize * sizeof(void*));
+		mag->size = magsize;
+		mag->rounds = 0;
+	}
+	__meta_free(stale);
+
+	__depot_lock(cp);
+	if (vc->prev) {
+		__depot_push(&cp->depot_full, vc->prev);
+		cp->depot_nr_full++;
+	}
+	__depot_unlock(cp);
+	vc->prev = vc->loaded;
+	vc->loaded = mag;
+	vc->nr_cached = mag->rounds + __mag_rounds(vc->prev);
+}
+
+/* Returns all of a magazine's rounds to the slab layer, and frees it. */
+static void __mag_purge(struct slab_cache *cp, struct slab_magazine *mag)
+{
+	if (!mag)
+		return;
+	__cache_lock(cp);
+	for (int i = 0; i < mag->rounds; i++)
+		__slab_free(cp, mag->objs[i]);
+	__cache_unlock(cp);
+	__meta_free(mag);
+}
+
+/* Empties the depot, returning all of its objects to the slab layer. */
+static void __depot_purge(struct slab_cache *cp)
+{
+	struct slab_magazine *full, *empty, *mag;
+
+	spin_pdr_lock(&cp->depot_lock);
+	full = cp->depot_full;
+	empty = cp->depot_empty;
+	cp->depot_full = cp->depot_empty = NULL;
+	cp->depot_nr_full = cp->depot_nr_empty = 0;
+	cp->depot_full_min = cp->depot_empty_min = 0;
+	spin_pdr_unlock(&cp->depot_lock);
+
+	while ((mag = __depot_pop(&full)))
+		__mag_purge(cp, mag);
+	while ((mag = __depot_pop(&empty)))
+		__mag_purge(cp, mag);
+}
+
+/* Front end: clients of caches use these */
+void *slab_cache_alloc(struct slab_cache *cp, int flags)
+{
+	struct slab_vcore_cache *vc = __vcore_cache_get(cp);
+	void *retval;
+
+	if (vc) {
+		if (__mag_empty(vc->loaded)) {
+			if (!__mag_empty(vc->prev))
+				__mag_swap(vc);
+			else if (__depot_get_full(cp, vc))
+				vc->depot_allocs++;
+			else
+				goto slab_layer;
+		}
+		retval = vc->loaded->objs[--vc->loaded->rounds];
+		vc->nr_cached--;
+		vc->allocs++;
+		__vcore_cache_put(vc);
+		return retval;
+	}
+slab_layer:
+	__cache_lock(cp);
+	retval = __slab_alloc(cp);
+	cp->slab_allocs++;
+	__cache_unlock(cp);
+	if (vc)
+		__vcore_cache_put(vc);
+	return retval;
+}
+
+void slab_cache_free(struct slab_cache *cp, void *buf)
+{
+	struct slab_vcore_cache *vc = __vcore_cache_get(cp);
+
+	if (vc) {
+		if (__mag_full(vc->loaded)) {
+			if (!__mag_full(vc->prev))
+				__mag_swap(vc);
+			else {
+				__depot_get_empty(cp, vc);
+				vc->depot_frees++;
+			}
+		}
+		vc->loaded->objs[vc->loaded->rounds++] = buf;
+		vc->nr_cached++;
+		vc->frees++;
+		__vcore_cache_put(vc);
+		return;
+	}
+	__cache_lock(cp);
+	__slab_free(cp, buf);
+	cp->slab_frees++;
+	__cache_unlock(cp);
+}
+
+/* Picks the offset of the first object in a new slab, out of the slack left
+ * at the end of it.  Successive slabs start another cache line further in, so
+ * that objects at the same index in different slabs don't all compete for the
+ * same cache sets (section 4.3 of the paper). */
+static size_t __slab_colour(struct slab_cache *cp, size_t slack)
+{
+	size_t colour;
+	if (cp->flags & SLAB_NO_COLOUR)
+		return 0;
+	if (cp->colour_next > slack)
+		cp->colour_next = 0;
+	colour = cp->colour_next;
+	cp->colour_next += ROUNDUP(ARCH_CL_SIZE, cp->align);
+	return colour;
 }
 
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
- * page_alloc fails, there are some serious issues.  This only grows by one slab
- * at a time.
- *
- * Grab the cache lock before calling this.
+ * mmap fails, there are some serious issues.  This only grows by one slab at a
+ * time, but maps memory a chunk at a time.
  *
- * TODO: think about page colouring issues with kernel memory allocation. */
+ * Grab the cache lock before calling this. */
 static void slab_cache_grow(struct slab_cache *cp)
 {
 	struct slab *a_slab;
 	struct slab_bufctl *a_bufctl;
 	void *a_page;
+	a_slab = __slot_alloc(cp);
+	a_page = __slab_base(cp, a_slab);
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
-		// Just get a single page for small slabs
-		a_page = mmap(0, PGSIZE, PROT_READ | PROT_WRITE,
-		              MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
-		assert(a_page != MAP_FAILED);
-		// the slab struct is stored at the end of the page
-		a_slab = (struct slab*)(a_page + PGSIZE -
-		                             sizeof(struct slab));
-		// Need to add room for the next free item pointer in the object buffer.
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+		// Need room for the next free item pointer, if it goes after the object
+		if (cp->free_ptr_offset)
+			a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t),
+			                           cp->align);
+		else
+			a_slab->obj_size = ROUNDUP(MAX(cp->obj_size, sizeof(uintptr_t)),
+			                           cp->align);
 		a_slab->num_busy_obj = 0;
-		a_slab->num_total_obj = (PGSIZE - sizeof(struct slab)) /
-		                        a_slab->obj_size;
-		// TODO: consider staggering this IAW section 4.3
-		a_slab->free_small_obj = a_page;
-		/* Walk and create the free list, which is circular.  Each item stores
-		 * the location of the next one at the end of the block. */
+		a_slab->num_total_obj = PGSIZE / a_slab->obj_size;
+		a_slab->colour = __slab_colour(cp, PGSIZE - a_slab->num_total_obj *
+		                                            a_slab->obj_size);
+		a_slab->free_small_obj = a_page + a_slab->colour;
+		/* Walk and create the free list.  Each item stores the location of the
+		 * next one at free_ptr_offset. */
 		void *buf = a_slab->free_small_obj;
 		for (int i = 0; i < a_slab->num_total_obj - 1; i++) {
 			// Initialize the object, if necessary
 			if (cp->ctor)
 				cp->ctor(buf, cp->obj_size);
-			*(uintptr_t**)(buf + cp->obj_size) = buf + a_slab->obj_size;
+			*(uintptr_t**)(buf + cp->free_ptr_offset) = buf + a_slab->obj_size;
 			buf += a_slab->obj_size;
 		}
-		*((uintptr_t**)(buf + cp->obj_size)) = NULL;
+		if (cp->ctor)
+			cp->ctor(buf, cp->obj_size);
+		*((uintptr_t**)(buf + cp->free_ptr_offset)) = NULL;
 	} else {
-		a_slab = slab_cache_alloc(slab_cache, 0);
-		// TODO: hash table for back reference (BUF)
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
-		// alloc n pages, such that it can hold at least 8 items
-		size_t num_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
-		                           PGSIZE;
-		// round up for the contiguous page allocator
-		void *buf = mmap(0, num_pgs * PGSIZE, PROT_READ | PROT_WRITE,
-		                 MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
-		assert(buf != MAP_FAILED);
+		a_slab->obj_size = ROUNDUP(cp->obj_size, cp->align);
 		a_slab->num_busy_obj = 0;
-		a_slab->num_total_obj = (num_pgs)*PGSIZE / a_slab->obj_size;
+		a_slab->num_total_obj = cp->slot_size / a_slab->obj_size;
+		a_slab->colour = __slab_colour(cp, cp->slot_size -
+		                                   a_slab->num_total_obj *
+		                                   a_slab->obj_size);
+		void *buf = a_page + a_slab->colour;
 		TAILQ_INIT(&a_slab->bufctl_freelist);
 		/* for each buffer, set up a bufctl and point to the buffer */
 		for (int i = 0; i < a_slab->num_total_obj; i++) {
@@ -300,48 +821,233 @@ static void slab_cache_grow(struct slab_cache *cp)
 			TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 			a_bufctl->buf_addr = buf;
 			a_bufctl->my_slab = a_slab;
-			// TODO: (BUF) write the bufctl reference at the bottom of the buffer.
-			*(struct slab_bufctl**)(buf + cp->obj_size) = a_bufctl;
 			buf += a_slab->obj_size;
 		}
 	}
 	// add a_slab to the empty_list
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	cp->nr_empty_slabs++;
+	cp->nr_grows++;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+/* This deallocs every slab from the empty list, after flushing the depot's
+ * magazines back into the slabs.  The background reaper is gentler; see
+ * __slab_cache_reap_ws(). */
 void slab_cache_reap(struct slab_cache *cp)
 {
 	struct slab *a_slab, *next;
 	
+	__depot_purge(cp);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
-	spin_pdr_lock(&cp->cache_lock);
+	__cache_lock(cp);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
+		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
 		slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
-	spin_pdr_unlock(&cp->cache_lock);
+	cp->nr_empty_slabs = cp->empty_min = 0;
+	__cache_unlock(cp);
+}
+
+/* Working set reaping (section 3.4 of the paper, and the depot's working set
+ * in the magazines paper).  Anything that sat unused in a cache for the whole
+ * interval since the last pass -- the minimum number of full and empty depot
+ * magazines, and of empty slabs, seen during the interval -- wasn't part of
+ * its working set, so we give it back.  Everything else stays, so a cache that
+ * cycles between a few slabs never thrashes between grow and destroy. */
+static void __slab_cache_reap_ws(struct slab_cache *cp)
+{
+	struct slab_magazine *mags = NULL, *mag;
+	struct slab *a_slab;
+	unsigned long n;
+
+	spin_pdr_lock(&cp->depot_lock);
+	for (n = cp->depot_full_min; n; n--) {
+		mag = __depot_pop(&cp->depot_full);
+		cp->depot_nr_full--;
+		__depot_push(&mags, mag);
+	}
+	for (n = cp->depot_empty_min; n; n--) {
+		mag = __depot_pop(&cp->depot_empty);
+		cp->depot_nr_empty--;
+		__depot_push(&mags, mag);
+	}
+	cp->depot_full_min = cp->depot_nr_full;
+	cp->depot_empty_min = cp->depot_nr_empty;
+	spin_pdr_unlock(&cp->depot_lock);
+	while ((mag = __depot_pop(&mags)))
+		__mag_purge(cp, mag);
+
+	/* The least recently emptied slabs are at the tail */
+	__cache_lock(cp);
+	for (n = cp->empty_min; n; n--) {
+		a_slab = TAILQ_LAST(&cp->empty_slab_list, slab_list);
+		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
+		cp->nr_empty_slabs--;
+		slab_destroy(cp, a_slab);
+	}
+	cp->empty_min = cp->nr_empty_slabs;
+	__cache_unlock(cp);
+}
+
+static volatile uint64_t slab_reap_interval = 0;
+static bool slab_reaper_running = false;
+
+/* Reaping is never urgent, so only do it when the cpu has nothing better to
+ * do.  Kernels without SCHED_IDLE get the lowest nice value instead. */
+static void __slab_reaper_deprioritize(void)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param))
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+}
+
+static void *__slab_reaper(void *arg)
+{
+	struct slab_cache *i;
+
+	__slab_reaper_deprioritize();
+	do {
+		while (slab_reap_interval) {
+			usleep(slab_reap_interval);
+			spin_pdr_lock(&slab_caches_lock);
+			SLIST_FOREACH(i, &slab_caches, link)
+				__slab_cache_reap_ws(i);
+			spin_pdr_unlock(&slab_caches_lock);
+		}
+		__sync_lock_release(&slab_reaper_running);
+		/* Keep going if we were restarted on our way out, since whoever did
+		 * it saw us still running and didn't start another thread */
+	} while (slab_reap_interval &&
+	         !__sync_lock_test_and_set(&slab_reaper_running, true));
+	return NULL;
+}
+
+/* The reaper gets a thread of its own, rather than one from the pthread pool:
+ * it runs for as long as reaping is on, and drops to idle priority, neither of
+ * which a capped, shared pool thread should be stuck with. */
+static void __slab_reaper_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t handle;
+
+	if (!slab_reap_interval || slab_reaper_running ||
+	    __sync_lock_test_and_set(&slab_reaper_running, true))
+		return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&handle, &attr, __slab_reaper, NULL))
+		__sync_lock_release(&slab_reaper_running);
+	pthread_attr_destroy(&attr);
+}
+
+void slab_set_reap_interval(uint64_t usec)
+{
+	assert(!in_vcore_context());
+	slab_reap_interval = usec;
+	if (usec)
+		__slab_reaper_start();
+}
+
+void slab_cache_stats(struct slab_cache *cp, struct slab_stats *stats)
+{
+	struct slab_vcore_cache *vc;
+	struct slab_magazine *mag;
+	struct slab_chunk *c;
+	struct slab *a_slab;
+
+	memset(stats, 0, sizeof(struct slab_stats));
+	stats->name = cp->name;
+	stats->obj_size = cp->obj_size;
+	stats->align = cp->align;
+	stats->flags = cp->flags;
+	/* Each vcore only ever updates its own counts, so we just add them up.  We
+	 * must not follow a vcore's magazine pointers: it may swap them out from
+	 * under us, and the reaper may free them once they are in the depot. */
+	for (int i = 0; i < MAX_VCORES; i++) {
+		vc = &cp->vcore_caches[i];
+		stats->mag_allocs += vc->allocs - vc->depot_allocs;
+		stats->mag_frees += vc->frees - vc->depot_frees;
+		stats->depot_allocs += vc->depot_allocs;
+		stats->depot_frees += vc->depot_frees;
+		stats->nr_cached += vc->nr_cached;
+	}
+
+	spin_pdr_lock(&cp->depot_lock);
+	for (mag = cp->depot_full; mag; mag = mag->next)
+		stats->nr_cached += mag->rounds;
+	stats->magsize = cp->magsize;
+	stats->depot_contended = cp->depot_contended;
+	spin_pdr_unlock(&cp->depot_lock);
+
+	__cache_lock(cp);
+	stats->slab_allocs = cp->slab_allocs;
+	stats->slab_frees = cp->slab_frees;
+	stats->grows = cp->nr_grows;
+	stats->reaps = cp->nr_reaps;
+	TAILQ_FOREACH(a_slab, &cp->full_slab_list, link)
+		stats->nr_full_slabs++;
+	TAILQ_FOREACH(a_slab, &cp->partial_slab_list, link)
+		stats->nr_partial_slabs++;
+	stats->nr_empty_slabs = cp->nr_empty_slabs;
+	TAILQ_FOREACH(c, &cp->chunks, link)
+		stats->nr_chunks++;
+	stats->bytes_mapped = stats->nr_chunks * cp->chunk_size;
+	/* Objects in magazines are allocated as far as the slabs are concerned.
+	 * Our view of the magazines may be slightly stale, so don't underflow. */
+	if (cp->nr_cur_alloc > stats->nr_cached)
+		stats->bytes_in_use = (cp->nr_cur_alloc - stats->nr_cached) *
+		                      cp->obj_size;
+	stats->lock_contended = cp->lock_contended;
+	__cache_unlock(cp);
+
+	stats->allocs = stats->mag_allocs + stats->depot_allocs +
+	                stats->slab_allocs;
+	stats->frees = stats->mag_frees + stats->depot_frees + stats->slab_frees;
+}
+
+void slab_cache_foreach(void (*fn)(struct slab_cache *cp, void *arg),
+                        void *arg)
+{
+	struct slab_cache *i;
+
+	spin_pdr_lock(&slab_caches_lock);
+	SLIST_FOREACH(i, &slab_caches, link)
+		fn(i, arg);
+	spin_pdr_unlock(&slab_caches_lock);
 }
 
 void EXPORT_SYMBOL print_slab_cache(struct slab_cache *cp)
 {
-	spin_pdr_lock(&cp->cache_lock);
+	struct slab_stats st;
+
+	slab_cache_stats(cp, &st);
 	printf("\nPrinting slab_cache:\n---------------------\n");
-	printf("Name: %s\n", cp->name);
-	printf("Objsize: %zu\n", cp->obj_size);
-	printf("Align: %d\n", cp->align);
-	printf("Flags: 0x%08x\n", cp->flags);
+	printf("Name: %s\n", st.name);
+	printf("Objsize: %zu\n", st.obj_size);
+	printf("Align: %d\n", st.align);
+	printf("Flags: 0x%08x\n", st.flags);
 	printf("Constructor: %p\n", cp->ctor);
 	printf("Destructor: %p\n", cp->dtor);
-	printf("Slab Full: %p\n", &cp->full_slab_list);
-	printf("Slab Partial: %p\n", &cp->partial_slab_list);
-	printf("Slab Empty:%p\n", &cp->empty_slab_list);
-	printf("Current Allocations: %lu\n", cp->nr_cur_alloc);
-	spin_pdr_unlock(&cp->cache_lock);
+	printf("Allocs: %lu (magazine %lu, depot %lu, slab %lu)\n",
+	       (unsigned long)st.allocs, (unsigned long)st.mag_allocs,
+	       (unsigned long)st.depot_allocs, (unsigned long)st.slab_allocs);
+	printf("Frees: %lu (magazine %lu, depot %lu, slab %lu)\n",
+	       (unsigned long)st.frees, (unsigned long)st.mag_frees,
+	       (unsigned long)st.depot_frees, (unsigned long)st.slab_frees);
+	printf("Slabs: %lu full, %lu partial, %lu empty (%lu grown, %lu reaped)\n",
+	       st.nr_full_slabs, st.nr_partial_slabs, st.nr_empty_slabs,
+	       (unsigned long)st.grows, (unsigned long)st.reaps);
+	printf("Magazines: %d rounds, %lu objects cached\n", st.magsize,
+	       st.nr_cached);
+	printf("Bytes: %zu in use, %zu mapped in %lu chunks\n", st.bytes_in_use,
+	       st.bytes_mapped, st.nr_chunks);
+	printf("Contention: %lu cache lock, %lu depot lock\n",
+	       (unsigned long)st.lock_contended,
+	       (unsigned long)st.depot_contended);
 }
 
 void EXPORT_SYMBOL print_slab(struct slab *slab)
@@ -369,9 +1075,17 @@ void EXPORT_SYMBOL print_slab(struct slab *slab)
 #undef slab_cache_free
 #undef slab_cache_init
 #undef slab_cache_reap
+#undef slab_cache_set_chunk_size
+#undef slab_set_reap_interval
+#undef slab_cache_stats
+#undef slab_cache_foreach
 EXPORT_ALIAS(INTERNAL(slab_cache_create), slab_cache_create)
 EXPORT_ALIAS(INTERNAL(slab_cache_destroy), slab_cache_destroy)
 EXPORT_ALIAS(INTERNAL(slab_cache_alloc), slab_cache_alloc)
 EXPORT_ALIAS(INTERNAL(slab_cache_free), slab_cache_free)
 EXPORT_ALIAS(INTERNAL(slab_cache_init), slab_cache_init)
 EXPORT_ALIAS(INTERNAL(slab_cache_reap), slab_cache_reap)
+EXPORT_ALIAS(INTERNAL(slab_cache_set_chunk_size), slab_cache_set_chunk_size)
+EXPORT_ALIAS(INTERNAL(slab_set_reap_interval), slab_set_reap_interval)
+EXPORT_ALIAS(INTERNAL(slab_cache_stats), slab_cache_stats)
+EXPORT_ALIAS(INTERNAL(slab_cache_foreach), slab_cache_foreach)
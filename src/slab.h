@@ -16,14 +16,17 @@
  *
  * For small objects, the slabs do not use the bufctls.  Instead, they point to
  * the next free object in the slab.  The free objects themselves hold the
- * address of the next free item.  The slab structure is stored at the end of
- * the page.  There is only one page per slab.
+ * address of the next free item: in their first word if the cache has no
+ * constructor, and right past the end of the object otherwise, so as not to
+ * clobber constructed state.  There is only one page per slab.
  *
- * TODO: Note, that this is a minor pain in the ass, and worth thinking about
- * before implementing.  To keep the constructor's state valid, we can't just
- * overwrite things, so we need to add an extra 4-8 bytes per object for the
- * pointer, and then pass over that data when we return the actual object's
- * address.  This also might fuck with alignment.
+ * Slabs are carved out of large chunks of memory, which are aligned to their
+ * size and keep the slab structures of all their slabs in a header at the
+ * start of the chunk.
+ *
+ * Large objects keep their exact size and alignment: each cache finds the
+ * bufctl of an allocated large object through a hash table keyed on its
+ * address.
  *
  * Ported directly from the Akaros kernel's slab allocator. */
 
@@ -35,11 +38,32 @@
 #include "parlib.h"
 #include "export.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Back in the day, their cutoff for "large objects" was 512B, based on
  * measurements and on not wanting more than 1/8 of internal fragmentation. */
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Default size of the chunks slabs are carved from.  Must be a power of 2. */
+#define SLAB_CHUNK_SIZE (2 * 1024 * 1024)
+
+/* A reasonable period for the background reaper, which trims caches back to
+ * their working set: slab_set_reap_interval(SLAB_REAP_INTERVAL_USEC). */
+#define SLAB_REAP_INTERVAL_USEC (5 * 1000000)
+
+/* Cache flags */
+#define SLAB_HUGEPAGE 0x0001 /* ask for transparent huge pages for chunks */
+#define SLAB_NO_COLOUR 0x0002 /* start every slab's objects at offset 0 */
+
+/* Magazine sizes, in objects, and how many times vcores have to find the
+ * depot lock taken before a cache moves to the next size up. */
+#define SLAB_MAG_INIT 16
+#define SLAB_MAG_MAX 256
+#define SLAB_MAG_CONTENTION 16
+
 struct slab;
 typedef struct slab slab_t;
 
@@ -49,6 +73,7 @@ typedef void (*slab_cache_dtor_t)(void *, size_t);
 /* Control block for buffers for large-object slabs */
 struct slab_bufctl {
 	TAILQ_ENTRY(slab_bufctl) link;
+	struct slab_bufctl *hash_next;
 	void *buf_addr;
 	struct slab *my_slab;
 };
@@ -63,6 +88,7 @@ struct slab {
 	size_t obj_size;
 	size_t num_busy_obj;
 	size_t num_total_obj;
+	size_t colour; /* offset of the first object */
 	union {
 		struct slab_bufctl_list bufctl_freelist;
 		void *free_small_obj;
@@ -70,22 +96,120 @@ struct slab {
 };
 TAILQ_HEAD(slab_list, slab);
 
+/* Header at the start of each chunk.  slabs[i] describes the i'th slot, which
+ * starts at slots + i * the cache's slot_size. */
+struct slab_chunk {
+	TAILQ_ENTRY(slab_chunk) link;
+	void *slots;
+	size_t nr_free;
+	size_t next_unused;           /* slots from here on were never used */
+	struct slab_list free_slabs;  /* released slots below next_unused */
+	struct slab slabs[];
+};
+TAILQ_HEAD(slab_chunk_list, slab_chunk);
+
+/* A magazine holds up to 'size' free objects, 'rounds' of which are loaded.
+ * See the magazine layer in slab.c. */
+struct slab_magazine {
+	struct slab_magazine *next;
+	int size;
+	int rounds;
+	void *objs[];
+};
+
+/* Each vcore's magazines for a given cache, and counts of the allocs and frees
+ * it handled through them, some of which needed a trip to the depot */
+struct slab_vcore_cache {
+	struct slab_magazine *loaded;
+	struct slab_magazine *prev;
+	/* Rounds in loaded and prev.  Only the owning vcore touches the magazines
+	 * themselves; slab_cache_stats() reads this instead. */
+	unsigned long nr_cached;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t depot_allocs;
+	uint64_t depot_frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /* Actual cache */
 typedef struct slab_cache {
 	SLIST_ENTRY(slab_cache) link;
 	spin_pdr_lock_t cache_lock;
 	const char *name;
 	size_t obj_size;
+	size_t free_ptr_offset;
 	int align;
 	int flags;
 	struct slab_list full_slab_list;
 	struct slab_list partial_slab_list;
 	struct slab_list empty_slab_list;
+	unsigned long nr_empty_slabs;
+	/* Fewest empty slabs since the reaper last ran: the ones it may free */
+	unsigned long empty_min;
 	slab_cache_ctor_t ctor;
 	slab_cache_dtor_t dtor;
 	unsigned long nr_cur_alloc;
+	/* Chunks, those with free slots first */
+	struct slab_chunk_list chunks;
+	size_t chunk_size;
+	size_t slot_size;
+	size_t slots_per_chunk;
+	size_t colour_next;
+	/* buf -> bufctl for allocated large objects, with 1 << hash_bits chains */
+	struct slab_bufctl **bufctl_hash;
+	unsigned int bufctl_hash_bits;
+	/* Magazine layer */
+	struct slab_vcore_cache *vcore_caches;
+	spin_pdr_lock_t depot_lock;
+	struct slab_magazine *depot_full;
+	struct slab_magazine *depot_empty;
+	unsigned long depot_nr_full;
+	unsigned long depot_nr_empty;
+	unsigned long depot_full_min;
+	unsigned long depot_empty_min;
+	int magsize;
+	unsigned int depot_contention;
+	/* Statistics, see slab_cache_stats() */
+	uint64_t slab_allocs;       /* allocs and frees that bypassed the */
+	uint64_t slab_frees;        /* magazines, under the cache lock */
+	uint64_t nr_grows;
+	uint64_t nr_reaps;
+	uint64_t lock_contended;
+	uint64_t depot_contended;
 } slab_cache_t;
 
+/* A snapshot of a cache's statistics.  Counts are since the cache was created.
+ * allocs = mag_allocs + depot_allocs + slab_allocs, where mag_allocs were
+ * served straight from a vcore's own magazines, depot_allocs needed a full
+ * magazine from the depot, and slab_allocs came from the slab layer under the
+ * cache lock.  Frees are split up the same way. */
+struct slab_stats {
+	const char *name;
+	size_t obj_size;
+	int align;
+	int flags;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t mag_allocs;
+	uint64_t mag_frees;
+	uint64_t depot_allocs;
+	uint64_t depot_frees;
+	uint64_t slab_allocs;
+	uint64_t slab_frees;
+	uint64_t grows;                /* slabs created */
+	uint64_t reaps;                /* slabs destroyed */
+	unsigned long nr_full_slabs;
+	unsigned long nr_partial_slabs;
+	unsigned long nr_empty_slabs;
+	unsigned long nr_chunks;
+	unsigned long nr_cached;       /* free objects sitting in magazines */
+	int magsize;
+	size_t bytes_in_use;           /* obj_size times the objects clients hold */
+	size_t bytes_mapped;           /* in chunks, including their headers */
+	uint64_t lock_contended;       /* times the cache lock was found taken */
+	uint64_t depot_contended;      /* same, for the depot lock */
+};
+
 /* List of all slab_caches, sorted in order of size */
 SLIST_HEAD(slab_cache_list, slab_cache);
 extern struct slab_cache_list slab_caches;
@@ -97,6 +221,10 @@ extern struct slab_cache_list slab_caches;
 # define slab_cache_free INTERNAL(slab_cache_free)
 # define slab_cache_init INTERNAL(slab_cache_init)
 # define slab_cache_reap INTERNAL(slab_cache_reap)
+# define slab_cache_set_chunk_size INTERNAL(slab_cache_set_chunk_size)
+# define slab_set_reap_interval INTERNAL(slab_set_reap_interval)
+# define slab_cache_stats INTERNAL(slab_cache_stats)
+# define slab_cache_foreach INTERNAL(slab_cache_foreach)
 #endif
 
 /* Cache management */
@@ -105,15 +233,38 @@ struct slab_cache *slab_cache_create(const char *name, size_t obj_size,
                                      slab_cache_ctor_t ctor,
                                      slab_cache_dtor_t dtor);
 void slab_cache_destroy(struct slab_cache *cp);
+/* Sets the size of the chunks this cache maps at a time, which must be a power
+ * of 2.  Call this before the first allocation from the cache. */
+void slab_cache_set_chunk_size(struct slab_cache *cp, size_t chunk_size);
 /* Front end: clients of caches use these */
 void *slab_cache_alloc(struct slab_cache *cp, int flags);
 void slab_cache_free(struct slab_cache *cp, void *buf);
 /* Back end: internal functions */
 void slab_cache_init(void);
 void slab_cache_reap(struct slab_cache *cp);
+/* A background thread periodically frees the slabs and depot magazines each
+ * cache did not need since its last pass.  It only runs once started with this
+ * call, which sets how often it runs, in usec; 0 stops it.  The thread runs at
+ * idle priority.  Don't call this from vcore context, since it may create the
+ * thread. */
+void slab_set_reap_interval(uint64_t usec);
+
+/* Statistics.  slab_cache_stats() fills in a snapshot of a cache's counters.
+ * The per-vcore counts (including the objects cached in each vcore's
+ * magazines) are read without stopping the vcores, so they are approximate and
+ * may be a little behind on a busy cache.  slab_cache_foreach() calls fn on every
+ * cache, in order of size, with the list of caches locked: fn may use any
+ * cache, but must not create or destroy one. */
+void slab_cache_stats(struct slab_cache *cp, struct slab_stats *stats);
+void slab_cache_foreach(void (*fn)(struct slab_cache *cp, void *arg),
+                        void *arg);
 
 /* Debug */
 void print_slab_cache(struct slab_cache *kc);
 void print_slab(struct slab *slab);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PARLIB_SLAB_H */
@@ -0,0 +1,155 @@
+/* See COPYING.LESSER for copyright information. */
+
+/* C++ wrappers around slab caches and kmalloc.  Header only; needs C++17 (and
+ * GNU extensions, for the C headers underneath).
+ *
+ * parlib::slab<T> is a slab cache sized and aligned for T.  create() and
+ * destroy() construct and destruct objects in place, and make_unique() wraps
+ * them in a std::unique_ptr that gives them back to the cache:
+ *
+ *   parlib::slab<request> requests("requests");
+ *   auto req = requests.make_unique(fd, buf);
+ *
+ * parlib::slab_resource() is a std::pmr::memory_resource on top of kmalloc's
+ * size-class caches, so STL containers get the same per-vcore magazines:
+ *
+ *   std::pmr::vector<int> v(parlib::slab_resource());
+ */
+
+#ifndef PARLIB_SLAB_HPP
+#define PARLIB_SLAB_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include "slab.h"
+#include "kmalloc.h"
+
+namespace parlib {
+
+template <typename T>
+class slab {
+	static_assert((alignof(T) & (alignof(T) - 1)) == 0,
+	              "alignment must be a power of 2");
+
+public:
+	static constexpr size_t object_size = sizeof(T);
+	static constexpr size_t object_align = alignof(T);
+
+	explicit slab(const char *name, int flags = 0)
+		: cache_(slab_cache_create(name, object_size, object_align, flags,
+		                           nullptr, nullptr))
+	{
+	}
+
+	/* All objects must have been destroyed by now */
+	~slab()
+	{
+		slab_cache_destroy(cache_);
+	}
+
+	slab(const slab &) = delete;
+	slab &operator=(const slab &) = delete;
+
+	template <typename... Args>
+	T *create(Args &&... args)
+	{
+		void *buf = slab_cache_alloc(cache_, 0);
+#if __cpp_exceptions
+		try {
+			return new (buf) T(std::forward<Args>(args)...);
+		} catch (...) {
+			slab_cache_free(cache_, buf);
+			throw;
+		}
+#else
+		return new (buf) T(std::forward<Args>(args)...);
+#endif
+	}
+
+	void destroy(T *obj)
+	{
+		if (!obj)
+			return;
+		obj->~T();
+		slab_cache_free(cache_, obj);
+	}
+
+	struct deleter {
+		slab *owner;
+		void operator()(T *obj) const
+		{
+			owner->destroy(obj);
+		}
+	};
+	using unique_ptr = std::unique_ptr<T, deleter>;
+
+	template <typename... Args>
+	unique_ptr make_unique(Args &&... args)
+	{
+		return unique_ptr(create(std::forward<Args>(args)...), deleter{this});
+	}
+
+	struct slab_stats stats() const
+	{
+		struct slab_stats st;
+		slab_cache_stats(cache_, &st);
+		return st;
+	}
+
+	void reap()
+	{
+		slab_cache_reap(cache_);
+	}
+
+	struct slab_cache *cache() const
+	{
+		return cache_;
+	}
+
+private:
+	struct slab_cache *cache_;
+};
+
+/* Every instance hands out memory from the same kmalloc caches, so any of them
+ * can free what another allocated. */
+class slab_memory_resource : public std::pmr::memory_resource {
+protected:
+	void *do_allocate(size_t bytes, size_t align) override
+	{
+		void *buf = parlib_kmalloc_align(bytes, align);
+		if (!buf) {
+#if __cpp_exceptions
+			throw std::bad_alloc();
+#else
+			abort();
+#endif
+		}
+		return buf;
+	}
+
+	void do_deallocate(void *buf, size_t bytes, size_t align) override
+	{
+		parlib_kfree(buf);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const
+		noexcept override
+	{
+		return this == &other ||
+		       dynamic_cast<const slab_memory_resource*>(&other) != nullptr;
+	}
+};
+
+inline slab_memory_resource *slab_resource()
+{
+	static slab_memory_resource resource;
+	return &resource;
+}
+
+} /* namespace parlib */
+
+#endif /* PARLIB_SLAB_HPP */
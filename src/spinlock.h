@@ -27,6 +27,7 @@
 #include "uthread.h"
 #include "atomic.h"
 #include "arch.h"
+#include "histogram.h"
 
 #define SPINLOCK_INITIALIZER {0}
 #define SPINPDR_INITIALIZER {0}
@@ -37,6 +38,9 @@ typedef struct spinlock {
 
 typedef struct spin_pdr_lock {
   int lock;
+#ifdef PARLIB_HISTOGRAMS
+  uint64_t locked_at;
+#endif
 } spin_pdr_lock_t;
 
 typedef struct {
@@ -77,11 +81,21 @@ static void spin_pdr_lock(struct spin_pdr_lock *pdr_lock)
   if (!in_vcore_context() && current_uthread)
     uth_disable_notifs();
   spinlock_lock((spinlock_t*)pdr_lock);
+#ifdef PARLIB_HISTOGRAMS
+  pdr_lock->locked_at = parlib_hist_begin();
+#endif
 }
 
 static void spin_pdr_unlock(struct spin_pdr_lock *pdr_lock)
 {
+#ifdef PARLIB_HISTOGRAMS
+  uint64_t locked_at = pdr_lock->locked_at;
+#endif
   spinlock_unlock((spinlock_t*)pdr_lock);
+#ifdef PARLIB_HISTOGRAMS
+  /* Still pinned to this vcore if we're a uthread */
+  parlib_hist_end(lock_hold, locked_at);
+#endif
   if (!in_vcore_context() && current_uthread)
     uth_enable_notifs();
 }
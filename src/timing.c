@@ -1,168 +1,193 @@
 #define _GNU_SOURCE
 #include <stdio.h>
-#include <sys/time.h>
-#include <sys/sysinfo.h>
+#include <time.h>
 #include <stdint.h>
-#include <sched.h>
+#include <cpuid.h>
 #include "internal/parlib.h"
+#include "common.h"
+#include "atomic.h"
 #include "export.h"
 #include "arch.h"
 #include "timing.h"
 
-uint64_t get_tsc_freq(void)
-{
-	static uint64_t *tsc_freqs = NULL;
-	if (tsc_freqs == NULL)
-		tsc_freqs = calloc(get_nprocs(), sizeof(uint64_t));
-
-	int cpuid = sched_getcpu();
-	if (tsc_freqs[cpuid] == 0) {
-		struct timeval prev;
-		struct timeval curr;
-		uint64_t beg = read_tsc_serialized();
-		gettimeofday(&prev, 0);
-		while (1) {
-			gettimeofday(&curr, 0);
-			if (curr.tv_sec > (prev.tv_sec + 1) ||
-				(curr.tv_sec > prev.tv_sec && curr.tv_usec > prev.tv_usec))
-				break;
-		}
-		uint64_t end = read_tsc_serialized();
-		tsc_freqs[cpuid] = end - beg;
-	}
-	return tsc_freqs[cpuid];
-}
+/* How long to spin when we have to measure the TSC frequency ourselves */
+#define TSC_CALIBRATE_NSEC 20000000
 
-void udelay(uint64_t usec)
-{
-	uint64_t start, end, now;
+static uint64_t __tsc_freq = 0;
 
-	start = read_tsc();
-    end = start + (get_tsc_freq() * usec) / 1000000;
-	do {
-        cpu_relax();
-        now = read_tsc();
-	} while (now < end || (now > start && end < start));
-}
+/* Conversion factors used by the inline tsc2*() and *2tsc() functions in
+ * timing.h.  All zero until the tsc frequency is known. */
+struct tsc_convs EXPORT_SYMBOL __tsc_convs;
 
-/* Not super accurate, due to overheads of reading tsc and looping */
-void ndelay(uint64_t nsec)
+/* Ask the CPU directly.  Leaf 0x15 gives the TSC/crystal ratio and (usually)
+ * the crystal frequency.  When the crystal frequency isn't enumerated, derive
+ * it from the base frequency in leaf 0x16, which runs at the same ratio. */
+static uint64_t __tsc_freq_cpuid(void)
 {
-	uint64_t start, end, now;
-
-	start = read_tsc();
-    end = start + (get_tsc_freq() * nsec) / 1000000000;
-	do {
-        cpu_relax();
-        now = read_tsc();
-	} while (now < end || (now > start && end < start));
+	unsigned int denom, numer, crystal, eax, ebx, ecx, edx;
+	unsigned int max_leaf = __get_cpuid_max(0, NULL);
+	uint64_t crystal_hz;
+
+	if (max_leaf < 0x15)
+		return 0;
+	__cpuid(0x15, denom, numer, crystal, edx);
+	if (denom == 0 || numer == 0)
+		return 0;
+	crystal_hz = crystal;
+	if (crystal_hz == 0 && max_leaf >= 0x16) {
+		__cpuid(0x16, eax, ebx, ecx, edx);
+		crystal_hz = (uint64_t)eax * 1000000 * denom / numer;
+	}
+	return crystal_hz * numer / denom;
 }
 
-/* Difference between the ticks in microseconds */
-uint64_t udiff(uint64_t begin, uint64_t end)
+/* Some kernels export the frequency they calibrated at boot. */
+static uint64_t __tsc_freq_sysfs(void)
 {
-	return (end - begin) * 1000000 /  get_tsc_freq();
+	unsigned long khz = 0;
+	FILE *f = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu", &khz) != 1)
+		khz = 0;
+	fclose(f);
+	return (uint64_t)khz * 1000;
 }
 
-/* Difference between the ticks in nanoseconds */
-uint64_t ndiff(uint64_t begin, uint64_t end)
+static uint64_t __raw_nsec(void)
 {
-	return (end - begin) * 1000000000 /  get_tsc_freq();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* Conversion btw tsc ticks and time units.  From Akaros's kern/src/time.c */
-
-/* We can overflow/wraparound when we multiply up, but we have to divide last,
- * or else we lose precision.  If we're too big and will overflow, we'll
- * sacrifice precision for correctness, and degrade to the next lower level
- * (losing 3 digits worth).  The recursive case shouldn't overflow, since it
- * called something that scaled down the tsc_time by more than 1000. */
-uint64_t tsc2sec(uint64_t tsc_time)
+/* Last resort: time a short busy loop against CLOCK_MONOTONIC_RAW.  Each
+ * endpoint is bracketed by two tsc reads, so a preemption between the tsc and
+ * clock reads only costs accuracy, not correctness. */
+static uint64_t __tsc_freq_calibrate(void)
 {
-	return tsc_time / get_tsc_freq();
+	uint64_t tsc_beg, tsc_end, ns_beg, ns_end;
+
+	tsc_beg = read_tsc_serialized();
+	ns_beg = __raw_nsec();
+	tsc_beg = (tsc_beg + read_tsc_serialized()) / 2;
+	do {
+		cpu_relax();
+		ns_end = __raw_nsec();
+	} while (ns_end - ns_beg < TSC_CALIBRATE_NSEC);
+	tsc_end = read_tsc_serialized();
+	ns_end = __raw_nsec();
+	tsc_end = (tsc_end + read_tsc_serialized()) / 2;
+	return (tsc_end - tsc_beg) * 1000000000 / (ns_end - ns_beg);
 }
 
-uint64_t tsc2msec(uint64_t tsc_time)
+/* Compute mult and shift such that (x * mult) >> shift == x * to / from, with
+ * mult as large as possible while staying near 2^63.  This is just long
+ * division of (to << shift) by from, one bit at a time, so it works without a
+ * 128 bit type.  It only runs once, so speed is irrelevant. */
+static void __calc_tsc_conv(struct tsc_conv *conv, uint64_t to, uint64_t from)
 {
-	if (mult_will_overflow_u64(tsc_time, 1000))
-		return tsc2sec(tsc_time) * 1000;
-	else
-		return (tsc_time * 1000) / get_tsc_freq();
+	uint64_t q = to / from;
+	uint64_t r = to % from;
+	unsigned int shift = 0;
+
+	while (!(q >> 62) && shift < 127) {
+		q <<= 1;
+		r <<= 1;
+		if (r >= from) {
+			q |= 1;
+			r -= from;
+		}
+		shift++;
+	}
+	/* Round mult up, so exact multiples (e.g. one second's worth of ticks)
+	 * convert exactly rather than landing one unit short. */
+	if (r)
+		q++;
+	conv->shift = shift;
+	/* Publish mult last, since a nonzero mult marks the conversion ready */
+	wmb();
+	conv->mult = q;
 }
 
-uint64_t tsc2usec(uint64_t tsc_time)
+static void __tsc_freq_init(void)
 {
-	if (mult_will_overflow_u64(tsc_time, 1000000))
-		return tsc2msec(tsc_time) * 1000;
-	else
-		return (tsc_time * 1000000) / get_tsc_freq();
+	uint64_t freq = __tsc_freq_cpuid();
+	if (freq == 0)
+		freq = __tsc_freq_sysfs();
+	if (freq == 0)
+		freq = __tsc_freq_calibrate();
+
+	__calc_tsc_conv(&__tsc_convs.tsc2sec, 1, freq);
+	__calc_tsc_conv(&__tsc_convs.tsc2msec, 1000, freq);
+	__calc_tsc_conv(&__tsc_convs.tsc2usec, 1000000, freq);
+	__calc_tsc_conv(&__tsc_convs.tsc2nsec, 1000000000, freq);
+	__calc_tsc_conv(&__tsc_convs.sec2tsc, freq, 1);
+	__calc_tsc_conv(&__tsc_convs.msec2tsc, freq, 1000);
+	__calc_tsc_conv(&__tsc_convs.usec2tsc, freq, 1000000);
+	__calc_tsc_conv(&__tsc_convs.nsec2tsc, freq, 1000000000);
+
+	/* get_tsc_freq() returns without waiting once this is set, so callers
+	 * must not see it before every conversion is ready */
+	wmb();
+	__tsc_freq = freq;
 }
 
-uint64_t tsc2nsec(uint64_t tsc_time)
+/* Both of the entry points below share this, so the init only ever runs once.
+ * Whoever loses the race waits for it to finish. */
+static void __tsc_init_once(void)
 {
-	if (mult_will_overflow_u64(tsc_time, 1000000000))
-		return tsc2usec(tsc_time) * 1000;
-	else
-		return (tsc_time * 1000000000) / get_tsc_freq();
+	run_once(__tsc_freq_init());
 }
 
-uint64_t sec2tsc(uint64_t sec)
+/* The TSC is invariant and synchronized across cores on any machine we care
+ * about, so we discover its frequency once for the whole process. */
+uint64_t get_tsc_freq(void)
 {
-	if (mult_will_overflow_u64(sec, get_tsc_freq()))
-		return (uint64_t)(-1);
-	else
-		return sec * get_tsc_freq();
+	if (likely(__tsc_freq))
+		return __tsc_freq;
+	__tsc_init_once();
+	return __tsc_freq;
 }
 
-uint64_t msec2tsc(uint64_t msec)
+/* Called when a conversion's mult is still zero, possibly while another thread
+ * is still filling them in, in which case this waits for it. */
+void __tsc_conv_init(void)
 {
-	if (mult_will_overflow_u64(msec, get_tsc_freq()))
-		return sec2tsc(msec / 1000);
-	else
-		return (msec * get_tsc_freq()) / 1000;
+	__tsc_init_once();
 }
 
-uint64_t usec2tsc(uint64_t usec)
+void udelay(uint64_t usec)
 {
-	if (mult_will_overflow_u64(usec, get_tsc_freq()))
-		return msec2tsc(usec / 1000);
-	else
-		return (usec * get_tsc_freq()) / 1000000;
+	uint64_t start, end, now;
+
+	start = read_tsc();
+	end = start + usec2tsc(usec);
+	do {
+        cpu_relax();
+        now = read_tsc();
+	} while (now < end || (now > start && end < start));
 }
 
-uint64_t nsec2tsc(uint64_t nsec)
+/* Not super accurate, due to overheads of reading tsc and looping */
+void ndelay(uint64_t nsec)
 {
-	if (mult_will_overflow_u64(nsec, get_tsc_freq()))
-		return usec2tsc(nsec / 1000);
-	else
-		return (nsec * get_tsc_freq()) / 1000000000;
-}
+	uint64_t start, end, now;
 
+	start = read_tsc();
+	end = start + nsec2tsc(nsec);
+	do {
+        cpu_relax();
+        now = read_tsc();
+	} while (now < end || (now > start && end < start));
+}
 
-#undef get_tsc_freq 
+#undef get_tsc_freq
 #undef udelay
 #undef ndelay
-#undef udiff
-#undef ndiff
-#undef tsc2sec
-#undef tsc2msec
-#undef tsc2usec
-#undef tsc2nsec
-#undef sec2tsc
-#undef msec2tsc
-#undef usec2tsc
-#undef nsec2tsc
+#undef __tsc_conv_init
 EXPORT_ALIAS(INTERNAL(get_tsc_freq), get_tsc_freq)
 EXPORT_ALIAS(INTERNAL(udelay), udelay)
 EXPORT_ALIAS(INTERNAL(ndelay), ndelay)
-EXPORT_ALIAS(INTERNAL(udiff), udiff)
-EXPORT_ALIAS(INTERNAL(ndiff), ndiff)
-EXPORT_ALIAS(INTERNAL(tsc2sec), tsc2sec)
-EXPORT_ALIAS(INTERNAL(tsc2msec), tsc2msec)
-EXPORT_ALIAS(INTERNAL(tsc2usec), tsc2usec)
-EXPORT_ALIAS(INTERNAL(tsc2nsec), tsc2nsec)
-EXPORT_ALIAS(INTERNAL(sec2tsc), sec2tsc)
-EXPORT_ALIAS(INTERNAL(msec2tsc), msec2tsc)
-EXPORT_ALIAS(INTERNAL(usec2tsc), usec2tsc)
-EXPORT_ALIAS(INTERNAL(nsec2tsc), nsec2tsc)
+EXPORT_ALIAS(INTERNAL(__tsc_conv_init), __tsc_conv_init)
 
@@ -2,38 +2,134 @@
 #define PARLIB_TIMING_H
 #include <stdbool.h>
 #include <stdint.h>
+#include "common.h"
 
 #ifdef COMPILING_PARLIB
 #define get_tsc_freq INTERNAL(get_tsc_freq)
 #define udelay INTERNAL(udelay)
 #define ndelay INTERNAL(ndelay)
-#define udiff INTERNAL(udiff)
-#define ndiff INTERNAL(ndiff)
-#define tsc2sec INTERNAL(tsc2sec)
-#define tsc2msec INTERNAL(tsc2msec)
-#define tsc2usec INTERNAL(tsc2usec)
-#define tsc2nsec INTERNAL(tsc2nsec)
-#define sec2tsc INTERNAL(sec2tsc)
-#define msec2tsc INTERNAL(msec2tsc)
-#define usec2tsc INTERNAL(usec2tsc)
-#define nsec2tsc INTERNAL(nsec2tsc)
+#define __tsc_conv_init INTERNAL(__tsc_conv_init)
 #endif
 
 uint64_t get_tsc_freq();
 void udelay(uint64_t usec);
 void ndelay(uint64_t nsec);
-uint64_t udiff(uint64_t begin, uint64_t end);
-uint64_t ndiff(uint64_t begin, uint64_t end);
-
-/* Conversion btw tsc ticks and time units.  From Akaros's kern/src/time.c */
-uint64_t tsc2sec(uint64_t tsc_time);
-uint64_t tsc2msec(uint64_t tsc_time);
-uint64_t tsc2usec(uint64_t tsc_time);
-uint64_t tsc2nsec(uint64_t tsc_time);
-uint64_t sec2tsc(uint64_t sec);
-uint64_t msec2tsc(uint64_t msec);
-uint64_t usec2tsc(uint64_t usec);
-uint64_t nsec2tsc(uint64_t nsec);
+
+/* Fixed-point conversion factor: out = (in * mult) >> shift, computed with a
+ * 128 bit intermediate.  Like the kernel's clocksource mult/shift, except we
+ * have a full 64 bits of mult, so there is no precision to trade away. */
+struct tsc_conv {
+	uint64_t mult;
+	unsigned int shift;
+};
+
+struct tsc_convs {
+	struct tsc_conv tsc2sec;
+	struct tsc_conv tsc2msec;
+	struct tsc_conv tsc2usec;
+	struct tsc_conv tsc2nsec;
+	struct tsc_conv sec2tsc;
+	struct tsc_conv msec2tsc;
+	struct tsc_conv usec2tsc;
+	struct tsc_conv nsec2tsc;
+};
+
+/* Fills in __tsc_convs, discovering the tsc frequency if necessary. */
+void __tsc_conv_init(void);
+
+static inline void __mul_u64_u64(uint64_t a, uint64_t b,
+                                 uint64_t *hi, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)a * b;
+	*hi = r >> 64;
+	*lo = r;
+#else
+	uint64_t al = (uint32_t)a, ah = a >> 32;
+	uint64_t bl = (uint32_t)b, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+	*lo = (mid << 32) | (uint32_t)ll;
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* Apply a conversion.  Results that don't fit in 64 bits saturate to
+ * (uint64_t)-1, which can only happen when converting up to tsc ticks. */
+static inline uint64_t __tsc_convert(const struct tsc_conv *conv, uint64_t in)
+{
+	uint64_t hi, lo;
+	if (unlikely(!conv->mult))
+		__tsc_conv_init();
+	__mul_u64_u64(in, conv->mult, &hi, &lo);
+	if (conv->shift >= 64)
+		return hi >> (conv->shift - 64);
+	if (unlikely(hi >> conv->shift))
+		return (uint64_t)(-1);
+	if (conv->shift == 0)
+		return lo;
+	return (hi << (64 - conv->shift)) | (lo >> conv->shift);
+}
+
+#define __TSC_CONV(name, in)                                   \
+({                                                             \
+	extern struct tsc_convs __tsc_convs;                         \
+	__tsc_convert(&__tsc_convs.name, in);                        \
+})
+
+/* Conversion btw tsc ticks and time units.  These used to be the divide-based
+ * versions from Akaros's kern/src/time.c. */
+static inline uint64_t tsc2sec(uint64_t tsc_time)
+{
+	return __TSC_CONV(tsc2sec, tsc_time);
+}
+
+static inline uint64_t tsc2msec(uint64_t tsc_time)
+{
+	return __TSC_CONV(tsc2msec, tsc_time);
+}
+
+static inline uint64_t tsc2usec(uint64_t tsc_time)
+{
+	return __TSC_CONV(tsc2usec, tsc_time);
+}
+
+static inline uint64_t tsc2nsec(uint64_t tsc_time)
+{
+	return __TSC_CONV(tsc2nsec, tsc_time);
+}
+
+static inline uint64_t sec2tsc(uint64_t sec)
+{
+	return __TSC_CONV(sec2tsc, sec);
+}
+
+static inline uint64_t msec2tsc(uint64_t msec)
+{
+	return __TSC_CONV(msec2tsc, msec);
+}
+
+static inline uint64_t usec2tsc(uint64_t usec)
+{
+	return __TSC_CONV(usec2tsc, usec);
+}
+
+static inline uint64_t nsec2tsc(uint64_t nsec)
+{
+	return __TSC_CONV(nsec2tsc, nsec);
+}
+
+/* Difference between the ticks in microseconds */
+static inline uint64_t udiff(uint64_t begin, uint64_t end)
+{
+	return tsc2usec(end - begin);
+}
+
+/* Difference between the ticks in nanoseconds */
+static inline uint64_t ndiff(uint64_t begin, uint64_t end)
+{
+	return tsc2nsec(end - begin);
+}
 
 # ifdef __i386__
 
@@ -30,6 +30,7 @@
 #include "arch.h"
 #include "tls.h"
 #include "event.h"
+#include "arena.h"
 
 #define printd(...)
 
@@ -126,6 +127,7 @@ void EXPORT_SYMBOL uthread_lib_init(struct uthread* uthread)
 		uthread->flags = NO_INTERRUPT;
 		uthread->sigstack = NULL;
 		uthread->disable_depth = 1;
+		uthread->arena = NULL;
 	
 #ifndef PARLIB_NO_UTHREAD_TLS
 		/* Associate the main thread's tls with the current tls as well */
@@ -221,6 +223,7 @@ void EXPORT_SYMBOL uthread_init(struct uthread *uthread)
 	uthread->flags = NO_INTERRUPT;
 	uthread->sigstack = NULL;
 	uthread->disable_depth = 1;
+	uthread->arena = NULL;
 
 #ifndef PARLIB_NO_UTHREAD_TLS
 	/* If a tls_desc is already set for this thread, reinit it... */
@@ -237,6 +240,11 @@ void EXPORT_SYMBOL uthread_init(struct uthread *uthread)
 
 void EXPORT_SYMBOL uthread_cleanup(struct uthread *uthread)
 {
+	/* Everything the thread allocated from its arena dies with it */
+	if (uthread->arena) {
+		arena_reset(uthread->arena);
+		uthread->arena = NULL;
+	}
 #ifndef PARLIB_NO_UTHREAD_TLS
 	printd("[U] thread %08p on vcore %d is DYING!\n", uthread, vcore_id());
 	/* Free the uthread's tls descriptor */
@@ -37,6 +37,8 @@
 #define UTH_EXT_BLK_MUTEX         1
 #define UTH_EXT_BLK_JUSTICE       2   /* whatever.  might need more options */
 
+struct parlib_arena;
+
 /* Bare necessities of a user thread.  1LSs should allocate a bigger struct and
  * cast their threads to uthreads when talking with vcore code.  Vcore/default
  * 2LS code won't touch udata or beyond. */
@@ -58,6 +60,7 @@ struct uthread {
 #endif
     struct syscall *sysc;
     uint64_t sysc_timeout;
+    struct parlib_arena *arena; /* reset by uthread_cleanup(), see arena.h */
 };
 typedef struct uthread uthread_t;
 
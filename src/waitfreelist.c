@@ -4,146 +4,495 @@
 #include <stdlib.h>
 #include "parlib.h"
 #include "export.h"
+#include "vcore.h"
 
-void wfl_init(struct wfl *list)
+#define WFL_BLOCK_MASK (~0ULL >> (64 - WFL_BLOCK_SLOTS))
+/* How many times we try to claim a bit in a block before moving on */
+#define WFL_BLOCK_TRIES 2
+/* Removals per shard between reclaim passes */
+#define WFL_RECLAIM_PERIOD 1024
+/* Reclaim passes a block must be found empty on before it is unlinked */
+#define WFL_RECLAIM_IDLE 2
+
+static inline unsigned __wfl_shard_id(void)
 {
-  list->size = 0;
-  list->first.next = NULL;
-  list->first.data = NULL;
-  list->head = &list->first;
+  return (unsigned)vcore_id() % WFL_NR_SHARDS;
 }
 
-void wfl_cleanup(struct wfl *list)
+/* Where in a block this shard's vcores start looking */
+static inline unsigned __wfl_start_bit(unsigned shard_id)
 {
-  assert(list->first.data == NULL);
-  struct wfl_slot *p = list->first.next; // don't free the first element
-  while (p != NULL) {
-    assert(p->data == NULL);
-    struct wfl_slot *tmp = p;
-    p = p->next;
-    free(tmp);
+  return shard_id * WFL_BLOCK_SLOTS / WFL_NR_SHARDS;
+}
+
+static inline struct wfl_block *__wfl_slot_block(struct wfl_slot *slot)
+{
+  return (struct wfl_block*)((uintptr_t)slot & ~(uintptr_t)(WFL_BLOCK_SIZE - 1));
+}
+
+/* Operations on a list that reclaims blocks announce themselves in their
+ * shard, so that the reclaimer knows when unlinked blocks are no longer in
+ * use.  This has to come before looking at any block. */
+static inline struct wfl_shard *__wfl_enter(struct wfl *list)
+{
+  struct wfl_shard *shard = &list->shards[__wfl_shard_id()];
+  if (list->reclaim)
+    __sync_fetch_and_add(&shard->active, 1);
+  return shard;
+}
+
+/* Notes that the shard had no operation in progress at some point in epoch
+ * 'epoch' or later.  The epoch must be read before active, so that the quiet
+ * moment comes after any retirement it vouches for. */
+static inline void __wfl_shard_quiet(struct wfl_shard *shard, size_t epoch)
+{
+  mb();
+  if (shard->active == 0 && shard->quiet_epoch < epoch)
+    shard->quiet_epoch = epoch;
+}
+
+static inline void __wfl_exit(struct wfl *list, struct wfl_shard *shard)
+{
+  if (list->reclaim && __sync_fetch_and_add(&shard->active, -1) == 1)
+    __wfl_shard_quiet(shard, list->epoch);
+}
+
+/* Called after __wfl_exit() by anything that removed n items */
+static inline void __wfl_maybe_reclaim(struct wfl *list,
+                                       struct wfl_shard *shard, size_t n)
+{
+  if (!list->reclaim)
+    return;
+  size_t before = shard->removals;
+  shard->removals = before + n;
+  if (before / WFL_RECLAIM_PERIOD != (before + n) / WFL_RECLAIM_PERIOD)
+    wfl_reclaim(list);
+}
+
+/* Walks every block once: from 'start' to the end of the list, then from the
+ * head up to 'start'.  Stops at the end if 'start' was unlinked meanwhile. */
+static inline struct wfl_block *__wfl_walk(struct wfl *list,
+                                           struct wfl_block *b,
+                                           struct wfl_block *start,
+                                           bool *wrapped)
+{
+  b = b->next;
+  if (b == NULL && !*wrapped) {
+    *wrapped = true;
+    b = list->head;
   }
+  return b == start ? NULL : b;
 }
 
-size_t wfl_capacity(struct wfl *list)
+/* Returns the first set bit at or after 'start', wrapping around.  bits must
+ * not be 0. */
+static inline unsigned __pick_bit(uint64_t bits, unsigned start)
 {
-  size_t res = 0;
-  for (struct wfl_slot *p = list->head; p != NULL; p = p->next)
-    res++;
-  return res;
+  uint64_t hi = bits & (~0ULL << start);
+  return __builtin_ctzll(hi ? hi : bits);
 }
 
-size_t wfl_size(struct wfl *list)
+/* Returns up to n set bits of 'bits', the first ones at or after 'start' */
+static inline uint64_t __pick_bits(uint64_t bits, unsigned start, size_t n)
 {
-  return list->size;
+  uint64_t picked = 0;
+  for (; n > 0 && bits != 0; n--) {
+    uint64_t bit = 1ULL << __pick_bit(bits, start);
+    picked |= bit;
+    bits &= ~bit;
+  }
+  return picked;
 }
 
-#if 0
-struct wfl_slot *wfl_insert(struct wfl *list, void *data)
+/* Sets a bit that is clear in *word and returns it, or -1 if we keep losing
+ * races or there is none. */
+static int __claim_bit(volatile uint64_t *word, uint64_t mask, unsigned start)
 {
-  struct wfl_slot *p = list->head; // list head is never null
-  struct wfl_slot *new_slot = NULL;
-  while (1) {
-    if (p->data == NULL) {
-      if (__sync_bool_compare_and_swap(&p->data, NULL, data)) {
-        free(new_slot);
-        return p;
-      }
-    }
+  uint64_t bits = *word;
+  for (int i = 0; i < WFL_BLOCK_TRIES; i++) {
+    uint64_t clear = ~bits & mask;
+    if (clear == 0)
+      return -1;
+    unsigned bit = __pick_bit(clear, start);
+    bits = __sync_fetch_and_or(word, 1ULL << bit);
+    if (!(bits & (1ULL << bit)))
+      return bit;
+  }
+  return -1;
+}
+
+/* Clears a bit that is set in *word and returns it, or -1. */
+static int __release_bit(volatile uint64_t *word, unsigned start)
+{
+  uint64_t bits = *word;
+  for (int i = 0; i < WFL_BLOCK_TRIES; i++) {
+    if (bits == 0)
+      return -1;
+    unsigned bit = __pick_bit(bits, start);
+    bits = __sync_fetch_and_and(word, ~(1ULL << bit));
+    if (bits & (1ULL << bit))
+      return bit;
+  }
+  return -1;
+}
 
-    if (p->next != NULL) {
-      p = p->next;
+/* Slot 'bit' of b was claimed in 'used': fill it and make it removable */
+static void __wfl_fill(struct wfl_shard *shard, struct wfl_block *b,
+                       unsigned bit, void *data)
+{
+  b->slots[bit].data = data;
+  __sync_fetch_and_or(&b->full, 1ULL << bit);
+  __sync_fetch_and_add(&shard->size, 1);
+}
+
+/* Slot 'bit' of b was taken out of 'full': empty it and let it be reused */
+static void *__wfl_empty(struct wfl_shard *shard, struct wfl_block *b,
+                         unsigned bit)
+{
+  void *data = b->slots[bit].data;
+  b->slots[bit].data = NULL;
+  __sync_fetch_and_and(&b->used, ~(1ULL << bit));
+  __sync_fetch_and_add(&shard->size, -1);
+  return data;
+}
+
+/* Only while holding a bit in b->used, so that the reclaimer, which only
+ * unlinks blocks with no bits set, also sees the new hint and clears it. */
+static inline void __wfl_set_hint(struct wfl_shard *shard, struct wfl_block *b)
+{
+  if (shard->hint != b)
+    shard->hint = b;
+}
+
+void wfl_init(struct wfl *list)
+{
+  memset(list, 0, sizeof(*list));
+}
+
+void wfl_enable_reclaim(struct wfl *list)
+{
+  list->reclaim = true;
+}
+
+static void __wfl_free_blocks(struct wfl_block *b, bool limbo)
+{
+  while (b != NULL) {
+    struct wfl_block *tmp = b;
+    b = limbo ? b->limbo_next : b->next;
+    free(tmp);
+  }
+}
+
+void wfl_cleanup(struct wfl *list)
+{
+  for (struct wfl_block *b = list->head; b != NULL; b = b->next)
+    assert(b->used == 0);
+  __wfl_free_blocks(list->head, false);
+  __wfl_free_blocks(list->limbo, true);
+  __wfl_free_blocks(list->retired, true);
+  bool reclaim = list->reclaim;
+  wfl_init(list);
+  list->reclaim = reclaim;
+}
+
+void wfl_reclaim(struct wfl *list)
+{
+  struct wfl_block *prev, *b, *next;
+
+  if (!list->reclaim || list->head == NULL)
+    return;
+  if (__sync_lock_test_and_set(&list->reclaiming, 1))
+    return;
+
+  /* Unlink blocks that were empty on our last few passes.  We never unlink
+   * the first block, nor the last one, which is where new blocks get appended.
+   * Setting all of a block's used bits keeps everyone out of it. */
+  prev = list->head;
+  for (b = prev->next; b != NULL && (next = b->next) != NULL; b = next) {
+    if (b->used != 0) {
+      b->idle = 0;
+      prev = b;
+      continue;
+    }
+    if (++b->idle < WFL_RECLAIM_IDLE ||
+        !__sync_bool_compare_and_swap(&b->used, 0, WFL_BLOCK_MASK)) {
+      prev = b;
       continue;
     }
+    prev->next = next;
+    for (int i = 0; i < WFL_NR_SHARDS; i++)
+      __sync_bool_compare_and_swap(&list->shards[i].hint, b, NULL);
+    b->limbo_next = list->limbo;
+    list->limbo = b;
+  }
 
-    if (new_slot == NULL) {
-      new_slot = parlib_aligned_alloc(ARCH_CL_SIZE, sizeof(struct wfl_slot));
-      if (new_slot == NULL)
-        abort();
-      new_slot->data = data;
-      new_slot->next = NULL;
-      wmb();
+  /* Anyone who might still be looking at a retired block started before it
+   * was retired, so once each shard has been quiet in a later epoch, they're
+   * all gone.  Shards needn't be quiet at the same time, nor on the same pass:
+   * one that never is at the moment we look gets noticed on its way out. */
+  for (int pass = 0; pass < 2; pass++) {
+    if (list->retired == NULL && list->limbo != NULL) {
+      list->retired = list->limbo;
+      list->limbo = NULL;
+      list->retired_epoch = list->epoch;
+      mb();
+      list->epoch++;
     }
- 
-    if (__sync_bool_compare_and_swap(&p->next, NULL, new_slot)) {
-      __sync_fetch_and_add(&list->size, 1);
-      return new_slot;
+    if (list->retired == NULL)
+      break;
+    bool quiet = true;
+    for (int i = 0; i < WFL_NR_SHARDS; i++) {
+      struct wfl_shard *shard = &list->shards[i];
+      __wfl_shard_quiet(shard, list->epoch);
+      quiet = quiet && shard->quiet_epoch > list->retired_epoch;
     }
-    p = list->head;
+    if (!quiet)
+      break;
+    __wfl_free_blocks(list->retired, true);
+    list->retired = NULL;
   }
+  __sync_lock_release(&list->reclaiming);
 }
-#endif
 
-struct wfl_slot *wfl_insert(struct wfl *list, void *data)
+size_t wfl_capacity(struct wfl *list)
 {
-  struct wfl_slot *p = list->head; // list head is never null
-  while (1) {
-    if (wfl_insert_into(list, p, data))
-      return p;
+  size_t res = 0;
+  /* Keeps a concurrent wfl_reclaim() from freeing blocks under the walk */
+  struct wfl_shard *shard = __wfl_enter(list);
+  for (struct wfl_block *b = list->head; b != NULL; b = b->next)
+    res += WFL_BLOCK_SLOTS;
+  __wfl_exit(list, shard);
+  return res;
+}
 
-    if (p->next == NULL)
-      break;
+size_t wfl_size(struct wfl *list)
+{
+  long size = 0;
+  for (int i = 0; i < WFL_NR_SHARDS; i++)
+    size += list->shards[i].size;
+  return size > 0 ? size : 0;
+}
+
+struct wfl_slot *wfl_insert(struct wfl *list, void *data)
+{
+  unsigned shard_id = __wfl_shard_id();
+  unsigned start_bit = __wfl_start_bit(shard_id);
+  struct wfl_shard *shard = __wfl_enter(list);
+  struct wfl_block *start = shard->hint ?: list->head;
+  struct wfl_block *b, *last = NULL;
+  bool wrapped = false;
+  int bit;
 
-    p = p->next;
+  /* Every block once, starting with the one we used last */
+  for (b = start; b != NULL; b = __wfl_walk(list, b, start, &wrapped)) {
+    if ((bit = __claim_bit(&b->used, WFL_BLOCK_MASK, start_bit)) >= 0) {
+      __wfl_set_hint(shard, b);
+      __wfl_fill(shard, b, bit, data);
+      __wfl_exit(list, shard);
+      return &b->slots[bit];
+    }
+    if (b->next == NULL)
+      last = b;
   }
 
-  struct wfl_slot *new_slot;
-  new_slot = parlib_aligned_alloc(ARCH_CL_SIZE, sizeof(struct wfl_slot));
-  if (new_slot == NULL)
-    abort();
-  new_slot->data = data;
-  new_slot->next = NULL;
+  struct wfl_block *new_block;
+  new_block = parlib_aligned_alloc(WFL_BLOCK_SIZE, sizeof(struct wfl_block));
+  memset(new_block, 0, sizeof(struct wfl_block));
+  new_block->used = 1ULL << start_bit;
 
   wmb();
 
-  struct wfl_slot *next;
-  while ((next = __sync_val_compare_and_swap(&p->next, NULL, new_slot)))
-    p = next;
+  struct wfl_block *next, **pp = last ? &last->next : &list->head;
+  while ((next = __sync_val_compare_and_swap(pp, NULL, new_block)))
+    pp = &next->next;
 
-  __sync_fetch_and_add(&list->size, 1);
-  return new_slot;
+  __wfl_set_hint(shard, new_block);
+  __wfl_fill(shard, new_block, start_bit, data);
+  __wfl_exit(list, shard);
+  return &new_block->slots[start_bit];
 }
 
 bool wfl_insert_into(struct wfl *list, struct wfl_slot *slot, void *data)
 {
-  if (slot->data != NULL)
+  struct wfl_block *b = __wfl_slot_block(slot);
+  uint64_t mask = 1ULL << (slot - b->slots);
+  struct wfl_shard *shard;
+
+  if (b->used & mask)
     return false;
-  bool ret = __sync_bool_compare_and_swap(&slot->data, NULL, data);
+  shard = __wfl_enter(list);
+  bool ret = !(__sync_fetch_and_or(&b->used, mask) & mask);
   if (ret)
-    __sync_fetch_and_add(&list->size, 1);
+    __wfl_fill(shard, b, slot - b->slots, data);
+  __wfl_exit(list, shard);
   return ret;
 }
 
 void *wfl_remove_from(struct wfl *list, struct wfl_slot *slot)
 {
-  if (slot->data == NULL)
+  struct wfl_block *b = __wfl_slot_block(slot);
+  uint64_t mask = 1ULL << (slot - b->slots);
+  struct wfl_shard *shard;
+  void *data = NULL;
+
+  if (!(b->full & mask))
     return NULL;
-  void *data = atomic_swap_ptr(&slot->data, 0);
-  if (data != NULL)
-    __sync_fetch_and_add(&list->size, -1);
+  shard = __wfl_enter(list);
+  if (__sync_fetch_and_and(&b->full, ~mask) & mask)
+    data = __wfl_empty(shard, b, slot - b->slots);
+  __wfl_exit(list, shard);
   return data;
 }
 
 void *wfl_remove(struct wfl *list)
 {
-  if (list->size == 0)
+  if (wfl_size(list) == 0)
     return NULL;
-  for (struct wfl_slot *p = list->head; p != NULL; p = p->next) {
-    void *data = wfl_remove_from(list, p);
-    if (data != NULL)
-      return data;
+
+  unsigned shard_id = __wfl_shard_id();
+  unsigned start_bit = __wfl_start_bit(shard_id);
+  struct wfl_shard *shard = __wfl_enter(list);
+  struct wfl_block *start = shard->hint ?: list->head;
+  struct wfl_block *b;
+  bool wrapped = false;
+  void *data = NULL;
+  int bit;
+
+  for (b = start; b != NULL; b = __wfl_walk(list, b, start, &wrapped)) {
+    if ((bit = __release_bit(&b->full, start_bit)) >= 0) {
+      __wfl_set_hint(shard, b);
+      data = __wfl_empty(shard, b, bit);
+      break;
+    }
   }
-  return NULL;
+  __wfl_exit(list, shard);
+  if (data != NULL)
+    __wfl_maybe_reclaim(list, shard, 1);
+  return data;
 }
 
 size_t wfl_remove_all(struct wfl *list, void *data)
 {
+  struct wfl_shard *shard = __wfl_enter(list);
   size_t n = 0;
-  for (struct wfl_slot *p = list->head; p != NULL; p = p->next) {
-    if (p->data == data)
-      n += __sync_bool_compare_and_swap(&p->data, data, NULL);
+
+  for (struct wfl_block *b = list->head; b != NULL; b = b->next) {
+    for (uint64_t full = b->full; full; full &= full - 1) {
+      unsigned bit = __builtin_ctzll(full);
+      uint64_t mask = 1ULL << bit;
+      if (b->slots[bit].data != data)
+        continue;
+      if (!(__sync_fetch_and_and(&b->full, ~mask) & mask))
+        continue;
+      /* The slot may have been emptied and refilled since we looked at it.
+       * If so, make its new item removable again. */
+      if (b->slots[bit].data != data) {
+        __sync_fetch_and_or(&b->full, mask);
+        continue;
+      }
+      __wfl_empty(shard, b, bit);
+      n++;
+    }
+  }
+  __wfl_exit(list, shard);
+  if (n > 0)
+    __wfl_maybe_reclaim(list, shard, n);
+  return n;
+}
+
+void wfl_insert_batch(struct wfl *list, void **items, size_t n)
+{
+  unsigned shard_id = __wfl_shard_id();
+  unsigned start_bit = __wfl_start_bit(shard_id);
+  struct wfl_shard *shard = __wfl_enter(list);
+  struct wfl_block *start = shard->hint ?: list->head;
+  struct wfl_block *b, *last = NULL;
+  bool wrapped = false;
+
+  /* Claim as many free slots as we need from each block in one go */
+  for (b = start; b != NULL && n > 0;
+       b = __wfl_walk(list, b, start, &wrapped)) {
+    for (int i = 0; i < WFL_BLOCK_TRIES && n > 0; i++) {
+      uint64_t clear = ~b->used & WFL_BLOCK_MASK;
+      if (clear == 0)
+        break;
+      uint64_t want = __pick_bits(clear, start_bit, n);
+      uint64_t got = want & ~__sync_fetch_and_or(&b->used, want);
+      if (got == 0)
+        continue;
+      __wfl_set_hint(shard, b);
+      for (uint64_t bits = got; bits; bits &= bits - 1)
+        b->slots[__builtin_ctzll(bits)].data = items[--n];
+      __sync_fetch_and_or(&b->full, got);
+      __sync_fetch_and_add(&shard->size, __builtin_popcountll(got));
+    }
+    if (b->next == NULL)
+      last = b;
+  }
+
+  /* Whatever is left goes into fresh blocks */
+  while (n > 0) {
+    struct wfl_block *new_block;
+    size_t count = n < WFL_BLOCK_SLOTS ? n : WFL_BLOCK_SLOTS;
+    uint64_t got = __pick_bits(WFL_BLOCK_MASK, start_bit, count);
+
+    new_block = parlib_aligned_alloc(WFL_BLOCK_SIZE, sizeof(struct wfl_block));
+    memset(new_block, 0, sizeof(struct wfl_block));
+    for (uint64_t bits = got; bits; bits &= bits - 1)
+      new_block->slots[__builtin_ctzll(bits)].data = items[--n];
+    new_block->used = got;
+
+    wmb();
+
+    struct wfl_block *next, **pp = last ? &last->next : &list->head;
+    while ((next = __sync_val_compare_and_swap(pp, NULL, new_block)))
+      pp = &next->next;
+    last = new_block;
+
+    __wfl_set_hint(shard, new_block);
+    __sync_fetch_and_or(&new_block->full, got);
+    __sync_fetch_and_add(&shard->size, count);
+  }
+  __wfl_exit(list, shard);
+}
+
+size_t wfl_remove_batch(struct wfl *list, void **items, size_t max)
+{
+  if (max == 0 || wfl_size(list) == 0)
+    return 0;
+
+  unsigned shard_id = __wfl_shard_id();
+  unsigned start_bit = __wfl_start_bit(shard_id);
+  struct wfl_shard *shard = __wfl_enter(list);
+  struct wfl_block *start = shard->hint ?: list->head;
+  struct wfl_block *b;
+  bool wrapped = false;
+  size_t n = 0;
+
+  /* Take as many items as we still want from each block in one go */
+  for (b = start; b != NULL && n < max;
+       b = __wfl_walk(list, b, start, &wrapped)) {
+    for (int i = 0; i < WFL_BLOCK_TRIES && n < max; i++) {
+      uint64_t full = b->full;
+      if (full == 0)
+        break;
+      uint64_t want = __pick_bits(full, start_bit, max - n);
+      uint64_t got = want & __sync_fetch_and_and(&b->full, ~want);
+      if (got == 0)
+        continue;
+      __wfl_set_hint(shard, b);
+      for (uint64_t bits = got; bits; bits &= bits - 1) {
+        unsigned bit = __builtin_ctzll(bits);
+        items[n++] = b->slots[bit].data;
+        b->slots[bit].data = NULL;
+      }
+      __sync_fetch_and_and(&b->used, ~got);
+      __sync_fetch_and_add(&shard->size, -__builtin_popcountll(got));
+    }
   }
-  __sync_fetch_and_add(&list->size, -n);
+  __wfl_exit(list, shard);
+  if (n > 0)
+    __wfl_maybe_reclaim(list, shard, n);
   return n;
 }
 
@@ -156,6 +505,10 @@ size_t wfl_remove_all(struct wfl *list, void *data)
 #undef wfl_remove_all
 #undef wfl_capacity
 #undef wfl_size
+#undef wfl_enable_reclaim
+#undef wfl_insert_batch
+#undef wfl_remove_batch
+#undef wfl_reclaim
 EXPORT_ALIAS(INTERNAL(wfl_init), wfl_init)
 EXPORT_ALIAS(INTERNAL(wfl_cleanup), wfl_cleanup)
 EXPORT_ALIAS(INTERNAL(wfl_insert), wfl_insert)
@@ -165,3 +518,7 @@ EXPORT_ALIAS(INTERNAL(wfl_remove_from), wfl_remove_from)
 EXPORT_ALIAS(INTERNAL(wfl_remove_all), wfl_remove_all)
 EXPORT_ALIAS(INTERNAL(wfl_capacity), wfl_capacity)
 EXPORT_ALIAS(INTERNAL(wfl_size), wfl_size)
+EXPORT_ALIAS(INTERNAL(wfl_enable_reclaim), wfl_enable_reclaim)
+EXPORT_ALIAS(INTERNAL(wfl_insert_batch), wfl_insert_batch)
+EXPORT_ALIAS(INTERNAL(wfl_remove_batch), wfl_remove_batch)
+EXPORT_ALIAS(INTERNAL(wfl_reclaim), wfl_reclaim)
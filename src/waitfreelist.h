@@ -2,21 +2,75 @@
 #define _PARLIB_WAITFREELIST_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include "arch.h"
 
+/* A WFL is a list of blocks, each holding WFL_BLOCK_SLOTS items and a pair of
+ * occupancy bitmaps: 'used' has a bit set for every slot claimed by an
+ * inserter or holding an item, and 'full' for every slot whose item is ready
+ * to be removed.  Inserting or removing an item is a test-and-set on one of
+ * these bits, so finding a free or full slot in a block is a single load
+ * instead of a walk over its slots.  Blocks are aligned to their size, which
+ * is how a slot finds its block.
+ *
+ * Vcores are spread over WFL_NR_SHARDS shards (by vcore id modulo
+ * WFL_NR_SHARDS), each on its own cache line.  A shard remembers the block its
+ * vcores last used, which is where they start looking next, and counts the
+ * items they inserted minus the ones they removed; wfl_size() adds them up.
+ * Vcores also start at their own offset within a block, so they mostly stay
+ * out of each other's way.  No operation retries on a block more than a
+ * couple of times before moving on, and an insertion that finds no free slot
+ * appends a fresh block, so everything stays wait-free.
+ *
+ * Blocks are never freed before wfl_cleanup(), unless the list was set up with
+ * wfl_enable_reclaim().  Then, every so often, a removal unlinks the blocks
+ * (other than the first one) that stayed empty since the last time it looked.
+ * Unlinked blocks are retired a batch at a time, bumping the list's epoch, and
+ * freed once every shard has been seen with no operation in progress in the
+ * new epoch.  Shards are seen quiet one at a time, by the reclaimer or by
+ * whoever leaves a shard empty, so a busy list still gets its blocks back. */
+#define WFL_BLOCK_SIZE 512
+/* As many as fit after the header's cache line, up to one per bitmap bit:
+ * (512 - 64) / 8 = 56 with 64 byte cache lines and 8 byte pointers, and 64 on
+ * 32 bit targets, where more would fit than the bitmaps can track. */
+#define __WFL_FIT_SLOTS ((WFL_BLOCK_SIZE - ARCH_CL_SIZE) / sizeof(void*))
+#define WFL_BLOCK_SLOTS (__WFL_FIT_SLOTS < 64 ? __WFL_FIT_SLOTS : 64)
+#define WFL_NR_SHARDS 8
+
 struct wfl_slot {
-  struct wfl_slot *next;
   void *data;
+};
+
+struct wfl_block {
+  struct wfl_block *next;
+  volatile uint64_t used;  /* claimed by an inserter, or holding an item */
+  volatile uint64_t full;  /* holding an item that can be removed */
+  unsigned idle;           /* reclaim passes that found it empty */
+  struct wfl_block *limbo_next;
+  struct wfl_slot slots[WFL_BLOCK_SLOTS] __attribute__((aligned(ARCH_CL_SIZE)));
+} __attribute__((aligned(WFL_BLOCK_SIZE)));
+
+struct wfl_shard {
+  struct wfl_block *hint;
+  volatile long size;
+  volatile long active;  /* operations in progress, if reclaiming */
+  volatile size_t quiet_epoch;  /* last epoch it was seen with none */
+  size_t removals;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct wfl {
-  struct wfl_slot *head;
-  struct wfl_slot first;
-  size_t size;
+  struct wfl_block *head;
+  bool reclaim;
+  volatile int reclaiming;
+  volatile size_t epoch;       /* bumped whenever blocks are retired */
+  struct wfl_block *limbo;     /* unlinked, waiting to be retired */
+  struct wfl_block *retired;   /* unlinked before 'epoch' last moved */
+  size_t retired_epoch;        /* freed once every shard is quiet past it */
+  struct wfl_shard shards[WFL_NR_SHARDS];
 };
 
-#define WFL_INITIALIZER(list) {&(list).first, {0, 0}}
+#define WFL_INITIALIZER(list) {0}
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,6 +86,10 @@ extern "C" {
 # define wfl_remove_all INTERNAL(wfl_remove_all)
 # define wfl_capacity INTERNAL(wfl_capacity)
 # define wfl_size INTERNAL(wfl_size)
+# define wfl_enable_reclaim INTERNAL(wfl_enable_reclaim)
+# define wfl_insert_batch INTERNAL(wfl_insert_batch)
+# define wfl_remove_batch INTERNAL(wfl_remove_batch)
+# define wfl_reclaim INTERNAL(wfl_reclaim)
 #endif
 
 /* Initialize a WFL. Memory for the wfl struct must be allocated externally. */
@@ -40,10 +98,27 @@ void wfl_init(struct wfl *list);
 /* Cleanup a WFL. Memory for the wfl struct must be freed externally. */
 void wfl_cleanup(struct wfl *list);
 
+/* Let a WFL free blocks that stay empty, so it doesn't keep its peak capacity
+ * forever.  Call this before anyone else uses the list.  Removed items' slots
+ * may then be freed at any time, so this is only for lists whose users don't
+ * hang on to the slots returned by wfl_insert() to use them with
+ * wfl_insert_into() later. */
+void wfl_enable_reclaim(struct wfl *list);
+
+/* Run a reclaim pass now, rather than waiting for removals to trigger one.  A
+ * no-op if reclaiming isn't enabled or someone else is already at it. */
+void wfl_reclaim(struct wfl *list);
+
 /* Insert an item into a WFL. A pointer to the slot where the data is stored in
  * the WFL is returned. This function will never fail. */
 struct wfl_slot *wfl_insert(struct wfl *list, void *data);
 
+/* Insert n items into a WFL, claiming as many slots as possible from each block
+ * with a single atomic operation.  Items that don't fit in the existing blocks
+ * go into fresh ones, WFL_BLOCK_SLOTS at a time.  Like wfl_insert(), this
+ * never fails. */
+void wfl_insert_batch(struct wfl *list, void **items, size_t n);
+
 /* Try to insert an item into a specific slot in a WFL. If the slot is already
  * occupied, return false, indicating a failure. Otherwise return true. */
 bool wfl_insert_into(struct wfl *list, struct wfl_slot *slot, void *data);
@@ -54,6 +129,11 @@ bool wfl_insert_into(struct wfl *list, struct wfl_slot *slot, void *data);
  * empty if an insertion was happening concurrently). */
 void *wfl_remove(struct wfl *list);
 
+/* Try to remove up to max items from the WFL in one pass, taking as many as
+ * possible from each block with a single atomic operation.  Return how many
+ * were stored in items.  Not synchronized with insertions, like wfl_remove(). */
+size_t wfl_remove_batch(struct wfl *list, void **items, size_t max);
+
 /* Try to remove an item from a specific slot in a WFL. If the slot is empty,
  * return NULL. This call is also not synchronized with insertions and may not
  * remove an item if an insertion happens concurrently. */
@@ -72,17 +152,21 @@ size_t wfl_capacity(struct wfl *list);
 
 /* Return the current size of the WFL (i.e. how many items are currently
  * present in). This call is not synchronized with either insertion or
- * removal, so it is just an estimate of the current size . */
+ * removal, so it is just an estimate of the current size .  It only reads the
+ * per-shard counters, never the blocks, so it is safe while blocks are being
+ * reclaimed. */
 size_t wfl_size(struct wfl *list);
 
 /* Iterate through all items in a WFL. Not synchronized with insertions or
  * removals, so care must be taken by the caller to ensure the integrity of the
- * items being operated on. */
+ * items being operated on.  This is a nested loop, so 'break' only leaves the
+ * current block.  Not for lists that reclaim blocks, unless nothing else is
+ * using the list. */
 #define wfl_foreach_unsafe(elm, list) \
-  for (struct wfl_slot *_p = (list)->head; \
-       elm = _p == NULL ? NULL : _p->data, _p != NULL; \
-       _p = _p->next) \
-    if (elm)
+  for (struct wfl_block *_b = (list)->head; _b != NULL; _b = _b->next) \
+    for (size_t _i = 0; \
+         _i < WFL_BLOCK_SLOTS && (elm = _b->slots[_i].data, true); _i++) \
+      if (elm)
 
 #ifdef __cplusplus
 }
@@ -33,5 +33,13 @@ int main() {
   set_alarm(&b);
   while (progress < 3);
 
+  /* A periodic alarm with some slack, aligned to an absolute deadline */
+  set_awaiter_abs(&a, time_usec() + 10000);
+  set_awaiter_periodic(&a, 10000);
+  set_awaiter_slack(&a, 1000);
+  set_alarm(&a);
+  while (progress < 8);
+  unset_alarm(&a);
+
   return 0;
 }
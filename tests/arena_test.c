@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+#include "timing.h"
+
+#define NUM_REQUESTS 10000
+#define OBJS_PER_REQUEST 200
+
+static void *objs[OBJS_PER_REQUEST];
+
+int main(int argc, char** argv)
+{
+  struct parlib_arena *arena = parlib_arena_create();
+  uint64_t begin;
+  char *big;
+
+  /* Objects are aligned, and don't overlap */
+  for (int i = 0; i < 10000; i++) {
+    char *buf = arena_alloc(arena, i % 100 + 1);
+    assert(!((uintptr_t)buf % ARENA_ALIGN));
+    memset(buf, i, i % 100 + 1);
+    if (i % 100 == 0)
+      objs[i / 100] = buf;
+  }
+  for (int i = 0; i < 100; i++)
+    assert(*(unsigned char*)objs[i] == (unsigned char)(i * 100));
+  big = arena_alloc(arena, 1024 * 1024);
+  memset(big, 0xff, 1024 * 1024);
+  assert(arena->allocated >= 1024 * 1024);
+
+  /* After a reset, we reuse the first chunk */
+  arena_reset(arena);
+  assert(arena->allocated == 0);
+  assert(arena->large == NULL && arena->chunks->next == NULL);
+  assert(arena_alloc(arena, 1) == (void*)(arena + 1));
+
+  begin = read_tsc();
+  for (int r = 0; r < NUM_REQUESTS; r++) {
+    for (int i = 0; i < OBJS_PER_REQUEST; i++)
+      objs[i] = arena_alloc(arena, 64 + i % 64);
+    arena_reset(arena);
+  }
+  printf("arena: %.1f nsec per object\n",
+         (double)tsc2nsec(read_tsc() - begin) /
+         (NUM_REQUESTS * OBJS_PER_REQUEST));
+
+  begin = read_tsc();
+  for (int r = 0; r < NUM_REQUESTS; r++) {
+    for (int i = 0; i < OBJS_PER_REQUEST; i++)
+      objs[i] = malloc(64 + i % 64);
+    for (int i = 0; i < OBJS_PER_REQUEST; i++)
+      free(objs[i]);
+  }
+  printf("malloc/free: %.1f nsec per object\n",
+         (double)tsc2nsec(read_tsc() - begin) /
+         (NUM_REQUESTS * OBJS_PER_REQUEST));
+
+  parlib_arena_destroy(arena);
+  printf("Test passed\n");
+  return 0;
+}
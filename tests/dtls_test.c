@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include "dtls.h"
+#include "timing.h"
+
+#define NUM_KEYS 40
+#define NUM_LOOKUPS 10000000
+#define NUM_THREADS 8
+#define NUM_LIFETIMES 20000
+#define NUM_THREAD_KEYS 8
+
+static dtls_key_t keys[NUM_KEYS];
+static int values[NUM_KEYS];
+static int dtor_calls;
+
+static void dtor(void *dtls)
+{
+  assert(dtls >= (void*)values && dtls < (void*)(values + NUM_KEYS));
+  __sync_fetch_and_add(&dtor_calls, 1);
+}
+
+/* Each loop is one thread's lifetime, as far as dtls is concerned: set a few
+ * keys, then tear them all down on exit. */
+static void *lifetimes(void *arg)
+{
+  for (int i = 0; i < NUM_LIFETIMES; i++) {
+    for (int k = 0; k < NUM_THREAD_KEYS; k++)
+      set_dtls(keys[k], &values[k]);
+    destroy_dtls();
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  uint64_t begin;
+  void * volatile sink;
+
+  /* More keys than fit inline in a thread's dtls data */
+  for (int i = 0; i < NUM_KEYS; i++)
+    keys[i] = dtls_key_create(dtor);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    assert(get_dtls(keys[i]) == NULL);
+    set_dtls(keys[i], &values[i]);
+  }
+  for (int i = 0; i < NUM_KEYS; i++)
+    assert(get_dtls(keys[i]) == &values[i]);
+  set_dtls(keys[3], &values[4]);
+  assert(get_dtls(keys[3]) == &values[4]);
+
+  begin = read_tsc();
+  for (int i = 0; i < NUM_LOOKUPS; i++)
+    sink = get_dtls(keys[i % NUM_KEYS]);
+  printf("get_dtls: %.1f nsec\n",
+         (double)tsc2nsec(read_tsc() - begin) / NUM_LOOKUPS);
+  (void)sink;
+
+  /* Destructors run once per value, and the values are gone afterwards */
+  destroy_dtls();
+  assert(dtor_calls == NUM_KEYS);
+  for (int i = 0; i < NUM_KEYS; i++)
+    assert(get_dtls(keys[i]) == NULL);
+
+  /* A deleted key's replacement starts out empty */
+  set_dtls(keys[0], &values[0]);
+  dtls_key_delete(keys[0]);
+  keys[0] = dtls_key_create(NULL);
+  assert(get_dtls(keys[0]) == NULL);
+  destroy_dtls();
+  assert(dtor_calls == NUM_KEYS);
+  keys[1] = dtls_key_create(NULL);
+  assert(get_dtls(keys[1]) == NULL);
+
+  /* Lots of threads coming and going at once */
+  pthread_t threads[NUM_THREADS];
+  for (int i = 0; i < NUM_THREAD_KEYS; i++)
+    keys[i] = dtls_key_create(dtor);
+  dtor_calls = 0;
+  begin = read_tsc();
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], NULL, lifetimes, NULL);
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  printf("%d threads: %.1f nsec per thread lifetime with %d keys\n",
+         NUM_THREADS, (double)tsc2nsec(read_tsc() - begin) /
+         (NUM_THREADS * NUM_LIFETIMES), NUM_THREAD_KEYS);
+  assert(dtor_calls == NUM_THREADS * NUM_LIFETIMES * NUM_THREAD_KEYS);
+
+  printf("Test passed\n");
+  return 0;
+}
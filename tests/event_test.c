@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "vcore.h"
+#include "event.h"
+#include "histogram.h"
+
+#define NR_PRODUCERS 4
+#define NR_EVENTS 10000
+
+volatile int single = 0;
+volatile int batched = 0;
+volatile int batches = 0;
+volatile int outside_vcore = 0;
+
+/* No 2LS here: vcore 0 just drains its events whenever it is signaled, and
+ * gives itself back up */
+void vcore_entry()
+{
+  handle_events();
+  vcore_yield();
+}
+
+static void check_context()
+{
+  if (!in_vcore_context() || vcore_id() != 0)
+    outside_vcore = 1;
+}
+
+void single_handler(struct event_msg *ev_msg, unsigned ev_type, void *data) {
+  check_context();
+  __sync_fetch_and_add((volatile int *)data, 1);
+  free(ev_msg);
+}
+
+void batch_handler(struct event_msg **ev_msgs, size_t count, unsigned ev_type,
+                   void *data) {
+  check_context();
+  assert(count > 0 && count <= EV_MAX_BATCH);
+  __sync_fetch_and_add(&batches, 1);
+  for (int i = 0; i < count; i++)
+    free(ev_msgs[i]);
+  __sync_fetch_and_add((volatile int *)data, count);
+}
+
+int single_type, batch_type;
+
+volatile int calls = 0;
+
+void call(void *arg) {
+  check_context();
+  __sync_fetch_and_add(&calls, (long)arg);
+}
+
+void *producer(void *arg) {
+  struct event_msg *msgs[8];
+  for (int i = 0; i < NR_EVENTS; i++)
+    send_event(malloc(sizeof(struct event_msg)), single_type, 0);
+  for (int i = 0; i < NR_EVENTS; i += 8) {
+    for (int j = 0; j < 8; j++)
+      msgs[j] = malloc(sizeof(struct event_msg));
+    send_events(msgs, 8, batch_type, 0);
+  }
+  return NULL;
+}
+
+int main() {
+  pthread_t producers[NR_PRODUCERS];
+
+  /* Brings up the vcores and the event queues */
+  vcore_lib_init();
+
+  single_type = register_ev_type(single_handler, NULL, (void *)&single);
+  batch_type = register_ev_type(NULL, batch_handler, (void *)&batched);
+  assert(single_type >= EV_NR_STATIC && batch_type >= EV_NR_STATIC);
+  printf("Registered event types %d and %d\n", single_type, batch_type);
+
+  for (int i = 0; i < NR_PRODUCERS; i++)
+    pthread_create(&producers[i], NULL, producer, NULL);
+  for (int i = 0; i < NR_PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+  while (single < NR_PRODUCERS * NR_EVENTS ||
+         batched < NR_PRODUCERS * NR_EVENTS)
+    usleep(1000);
+  assert(single == NR_PRODUCERS * NR_EVENTS);
+  assert(batched == NR_PRODUCERS * NR_EVENTS);
+  assert(batches <= NR_PRODUCERS * NR_EVENTS / 8);
+  printf("Handled %d batched events in %d batches\n", batched, batches);
+#ifdef PARLIB_HISTOGRAMS
+  struct histogram_counts c;
+  histogram_snapshot(&parlib_event_latency_hist, &c);
+  assert(c.total >= 2 * NR_PRODUCERS * NR_EVENTS);
+  print_histogram(&parlib_event_latency_hist);
+#endif
+
+  /* Remote calls, async and sync, to vcore 0.  Calls to one vcore run in
+   * order, so once the sync ones return all of them have run. */
+  vcore_call(0, call, (void *)1);
+  vcore_call_many(1, call, (void *)1);
+  vcore_call_sync(0, call, (void *)1);
+  assert(calls == 3);
+  vcore_call_many_sync(1, call, (void *)1);
+  assert(calls == 4);
+  printf("Ran %d remote calls\n", calls);
+
+  assert(!outside_vcore);
+  deregister_ev_type(single_type);
+  deregister_ev_type(batch_type);
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <assert.h>
+#include "histogram.h"
+#include "spinlock.h"
+
+#define NUM_VALUES 100000
+
+int main(int argc, char** argv)
+{
+  struct histogram *h = histogram_create("test_histogram", 0);
+  struct histogram_counts c;
+
+  /* Every bucket must map back to a value that lands in that bucket */
+  for (int i = 0; i < HIST_NR_BUCKETS; i++)
+    assert(histogram_bucket(histogram_bucket_value(i)) == i);
+  assert(histogram_bucket((uint64_t)-1) == HIST_NR_BUCKETS - 1);
+
+  for (int i = 1; i <= NUM_VALUES; i++)
+    histogram_record(h, i);
+  histogram_snapshot(h, &c);
+  assert(c.total == NUM_VALUES);
+  assert(c.min == 1 && c.max == NUM_VALUES);
+
+  /* Percentiles are accurate to within one sub-bucket (~3%) */
+  for (double p = 10; p < 100; p += 10) {
+    uint64_t v = histogram_percentile(&c, p);
+    double expected = p / 100 * NUM_VALUES;
+    printf("P%g: %lu (expected %.0f)\n", p, (unsigned long)v, expected);
+    assert(v >= expected && v <= expected * (1 + 1.0 / HIST_SUB_BUCKETS));
+  }
+  assert(histogram_percentile(&c, 100) == NUM_VALUES);
+  print_histogram(h);
+
+  histogram_reset(h);
+  histogram_snapshot(h, &c);
+  assert(c.total == 0);
+
+  /* Time a few read_tsc() calls, just to exercise the tsc reporting */
+  struct histogram *t = histogram_create("read_tsc", HIST_TSC);
+  for (int i = 0; i < 1000; i++)
+    histogram_record_since(t, read_tsc());
+  print_histogram(t);
+
+#ifdef PARLIB_HISTOGRAMS
+  /* spin_pdr locks time themselves */
+  spin_pdr_lock_t lock = SPINPDR_INITIALIZER;
+  histogram_snapshot(&parlib_lock_hold_hist, &c);
+  uint64_t before = c.total;
+  for (int i = 0; i < 1000; i++) {
+    spin_pdr_lock(&lock);
+    spin_pdr_unlock(&lock);
+  }
+  histogram_snapshot(&parlib_lock_hold_hist, &c);
+  assert(c.total >= before + 1000);
+  print_parlib_histograms();
+#endif
+
+  histogram_destroy(h);
+  histogram_destroy(t);
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "kmalloc.h"
+#include "timing.h"
+
+#define NUM_BUFS 10000
+#define BENCH_ITERS 1000000
+
+static void *bufs[NUM_BUFS];
+static void * volatile sink;
+
+int main(int argc, char** argv)
+{
+  uint64_t begin;
+
+  /* Every size gets at least what it asked for, suitably aligned, and no more
+   * than a quarter extra once past the smallest classes. */
+  for (size_t size = 0; size <= 2 * KMALLOC_MAX_CLASS; size += 7) {
+    char *buf = parlib_kmalloc(size);
+    size_t usable = parlib_kmalloc_usable_size(buf);
+    assert(buf && !((uintptr_t)buf % KMALLOC_ALIGN));
+    assert(usable >= size);
+    if (size > 64 && size <= KMALLOC_MAX_CLASS / 2)
+      assert(usable + sizeof(struct kmalloc_tag) <=
+             (size + sizeof(struct kmalloc_tag)) * 5 / 4);
+    memset(buf, 0xab, usable);
+    parlib_kfree(buf);
+  }
+
+  for (size_t align = 1; align <= 8192; align *= 2) {
+    char *buf = parlib_kmalloc_align(100, align);
+    assert(!((uintptr_t)buf % align));
+    assert(parlib_kmalloc_usable_size(buf) >= 100);
+    memset(buf, 0xcd, 100);
+    parlib_kfree(buf);
+  }
+
+  /* realloc keeps the contents */
+  char *buf = parlib_kmalloc(10);
+  for (int i = 0; i < 10; i++)
+    buf[i] = i;
+  for (size_t size = 16; size <= 4 * KMALLOC_MAX_CLASS; size *= 2) {
+    buf = parlib_krealloc(buf, size);
+    for (int i = 0; i < 10; i++)
+      assert(buf[i] == i);
+  }
+  parlib_kfree(buf);
+  parlib_kfree(NULL);
+
+  buf = parlib_kzmalloc(1000);
+  for (int i = 0; i < 1000; i++)
+    assert(buf[i] == 0);
+  parlib_kfree(buf);
+
+  for (int i = 0; i < NUM_BUFS; i++) {
+    bufs[i] = parlib_kmalloc(i % 3000);
+    memset(bufs[i], i, i % 3000);
+  }
+  for (int i = 0; i < NUM_BUFS; i++) {
+    if (i % 3000)
+      assert(((unsigned char*)bufs[i])[i % 3000 - 1] == (unsigned char)i);
+    parlib_kfree(bufs[i]);
+  }
+
+  begin = read_tsc();
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    sink = parlib_kmalloc(i % 512);
+    parlib_kfree(sink);
+  }
+  printf("kmalloc/kfree: %.1f nsec per pair\n",
+         (double)tsc2nsec(read_tsc() - begin) / BENCH_ITERS);
+  begin = read_tsc();
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    sink = malloc(i % 512);
+    free(sink);
+  }
+  printf("malloc/free: %.1f nsec per pair\n",
+         (double)tsc2nsec(read_tsc() - begin) / BENCH_ITERS);
+
+  printf("Test passed\n");
+  return 0;
+}
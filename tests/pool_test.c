@@ -20,10 +20,143 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "pool.h"
+#include "uthread.h"
+#include "vcore.h"
 
 #define NUM_OBJECTS 1000
+#define BIG_POOL_OBJECTS 100000
+
+/* More than 2^16 objects, which used to wrap around in pool_free() */
+static void test_big_pool(void)
+{
+  pool_t pool;
+  char *buffer = malloc(BIG_POOL_OBJECTS);
+  void **queue = malloc(BIG_POOL_OBJECTS * sizeof(void*));
+  void **objects = malloc(BIG_POOL_OBJECTS * sizeof(void*));
+
+  pool_init(&pool, buffer, queue, BIG_POOL_OBJECTS, 1);
+  for (int round = 0; round < 3; round++) {
+    assert(pool_alloc_n(&pool, objects, BIG_POOL_OBJECTS / 2) ==
+           BIG_POOL_OBJECTS / 2);
+    assert(pool_free_n(&pool, objects, BIG_POOL_OBJECTS / 2) ==
+           BIG_POOL_OBJECTS / 2);
+  }
+  assert(pool_alloc_n(&pool, objects, BIG_POOL_OBJECTS + 1) ==
+         BIG_POOL_OBJECTS);
+  assert(pool_alloc(&pool) == NULL);
+  for (int i = 0; i < BIG_POOL_OBJECTS; i++)
+    assert(objects[i] >= (void*)buffer &&
+           objects[i] < (void*)buffer + BIG_POOL_OBJECTS);
+  assert(pool_free_n(&pool, objects, BIG_POOL_OBJECTS) == BIG_POOL_OBJECTS);
+  assert(pool_free(&pool, buffer) == -1);
+  free(objects);
+  free(queue);
+  free(buffer);
+}
+
+/* Threads hammer a cpool, each marking the objects it holds, so that handing
+ * the same object out twice is caught. */
+#define CPOOL_OBJECTS 4096
+#define CPOOL_THREADS 4
+#define CPOOL_ITERS 100000
+
+static cpool_t cpool;
+static struct cpool_slot cpool_ring[CPOOL_OBJECTS];
+static int cpool_owner[CPOOL_OBJECTS];
+
+static void cpool_hammer(int id)
+{
+  void *objects[64];
+  unsigned int seed = id;
+
+  for (int i = 0; i < CPOOL_ITERS; i++) {
+    size_t n = rand_r(&seed) % 64 + 1;
+    n = cpool_alloc_n(&cpool, objects, n);
+    for (size_t j = 0; j < n; j++) {
+      int *owner = (int*)objects[j];
+      assert(__sync_bool_compare_and_swap(owner, 0, id));
+    }
+    for (size_t j = 0; j < n; j++) {
+      int *owner = (int*)objects[j];
+      assert(__sync_bool_compare_and_swap(owner, id, 0));
+    }
+    assert(cpool_free_n(&cpool, objects, n) == n);
+  }
+}
+
+static void *cpool_thread(void *arg)
+{
+  cpool_hammer((long)arg + 1);
+  return NULL;
+}
+
+static void test_cpool(void)
+{
+  pthread_t threads[CPOOL_THREADS];
+  void *object;
+
+  /* The objects are the owner flags themselves */
+  cpool_init(&cpool, cpool_owner, cpool_ring, CPOOL_OBJECTS, sizeof(int));
+  assert(cpool_available(&cpool) == CPOOL_OBJECTS);
+  for (long i = 0; i < CPOOL_THREADS; i++)
+    pthread_create(&threads[i], NULL, cpool_thread, (void*)i);
+  for (int i = 0; i < CPOOL_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  assert(cpool_available(&cpool) == CPOOL_OBJECTS);
+
+  object = cpool_alloc(&cpool);
+  assert(object);
+  assert(cpool_free(&cpool, object) == 0);
+  assert(cpool_free(&cpool, object) == -1);
+  printf("cpool: %d threads, no object handed out twice\n", CPOOL_THREADS);
+}
+
+/* The same on vcores, where allocations go through the per-vcore caches */
+volatile int b1, b2;
+
+static void test_cpool_vcores(void)
+{
+  size_t cached = 0;
+
+  __sync_fetch_and_add(&b1, 1);
+  while (b1 < max_vcores());
+
+  cpool_hammer(vcore_id() + 1);
+  assert(cpool_alloc(&cpool) != NULL);
+
+  __sync_fetch_and_add(&b2, 1);
+  while (b2 < max_vcores());
+
+  if (vcore_id() != 0)
+    return;
+  for (int i = 0; i < max_vcores(); i++) {
+    assert(cpool.caches[i].count <= CPOOL_CACHE_SIZE);
+    cached += cpool.caches[i].count;
+  }
+  assert(cached > 0);
+  assert(cpool_available(&cpool) == CPOOL_OBJECTS - max_vcores());
+  printf("cpool: %ld vcores, %lu objects cached, no object handed out "
+         "twice\n", max_vcores(), (unsigned long)cached);
+}
+
+void vcore_entry()
+{
+  if (vcore_saved_ucontext) {
+    void *cuc = vcore_saved_ucontext;
+    set_tls_desc(vcore_saved_tls_desc);
+    parlib_setcontext(cuc);
+    assert(0);
+  }
+
+  test_cpool_vcores();
+  if (vcore_id() == 0)
+    exit(0);
+  vcore_yield();
+}
 
 int main(int argc, char** argv)
 {
@@ -50,5 +183,14 @@ int main(int argc, char** argv)
     pool_free(&pool, test_buffer[i]);
   }
   printf("pool_available: %lu\n", pool_available(&pool));
+
+  test_big_pool();
+  test_cpool();
+
+  vcore_lib_init();
+  vcore_request(max_vcores());
+  __set_tls_desc(vcore_tls_descs(0), 0);
+  vcore_saved_ucontext = NULL;
+  vcore_entry();
 }
 
@@ -2,6 +2,7 @@
 #include "spinlock.h"
 #include <unistd.h>
 #include <stdio.h>
+#include <assert.h>
 #include <pthread.h>
 
 static spinlock_t lock = SPINLOCK_INITIALIZER;
@@ -26,7 +27,60 @@ void *func(void *arg)
   return 0;
 }
 
+#define NUM_ORDERED (2 * POOLED_PTHREAD_QUEUE_SIZE)
+
+static volatile long next_job;
+static volatile int out_of_order;
+
+void *ordered(void *arg)
+{
+  if ((long)arg != next_job)
+    out_of_order = 1;
+  next_job++;
+  usleep(10);
+  return 0;
+}
+
+static volatile int done;
+
+void *counted(void *arg)
+{
+  usleep(1000);
+  __sync_fetch_and_add(&done, 1);
+  return 0;
+}
+
+#define NUM_SPAWNERS 2
+#define NUM_SPAWNED (POOLED_PTHREAD_QUEUE_SIZE + 16)
+
+static volatile int spawned;
+
+void *quick(void *arg)
+{
+  __sync_fetch_and_add(&spawned, 1);
+  return 0;
+}
+
+/* Fills the queue from a pool thread, with every pool thread doing the same */
+void *spawner(void *arg)
+{
+  for (int i = 0; i < NUM_SPAWNED; i++)
+    pooled_pthread_start(&quick, NULL);
+  return 0;
+}
+
+static void wait_for_idle(int num_threads)
+{
+  struct pthread_pool_stats stats;
+  do {
+    usleep(1000);
+    pooled_pthread_stats(&stats);
+  } while (stats.num_queued || stats.num_idle != stats.num_threads ||
+           (num_threads >= 0 && stats.num_threads != num_threads));
+}
+
 int main() {
+  struct pthread_pool_stats stats;
   int i;
   main_thread = pthread_self();
   for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
@@ -37,5 +91,49 @@ int main() {
     if (i % 10 == 0)
       usleep(10000);
   }
+  wait_for_idle(-1);
+
+  /* With one thread, jobs run in the order they were queued, and submitters
+   * wait once the queue is full */
+  pooled_pthread_set_max_threads(1);
+  pooled_pthread_set_idle_timeout(10000);
+  wait_for_idle(0);
+  for (long j = 0; j < NUM_ORDERED; j++)
+    pooled_pthread_start(&ordered, (void*)j);
+  wait_for_idle(-1);
+  pooled_pthread_stats(&stats);
+  assert(next_job == NUM_ORDERED && !out_of_order);
+  assert(stats.queue_full_waits > 0);
+  assert(stats.num_threads <= 1);
+
+  /* Never more than max_threads, and idle ones go away */
+  pooled_pthread_set_max_threads(4);
+  for (i = 0; i < 200; i++)
+    pooled_pthread_start(&counted, NULL);
+  while (done < 200)
+    usleep(1000);
+  pooled_pthread_stats(&stats);
+  assert(stats.num_threads <= 4);
+  wait_for_idle(0);
+
+  /* Pool threads never wait for room: with all of them submitting, that would
+   * be for good.  They get extra threads past max_threads instead. */
+  pooled_pthread_set_max_threads(NUM_SPAWNERS);
+  for (i = 0; i < NUM_SPAWNERS; i++)
+    pooled_pthread_start(&spawner, NULL);
+  while (spawned < NUM_SPAWNERS * NUM_SPAWNED)
+    usleep(1000);
+  pooled_pthread_stats(&stats);
+  assert(stats.extra_threads > 0);
+  wait_for_idle(0);
+  pooled_pthread_stats(&stats);
+  printf("pool: %d threads max, %lu created, %lu reaped, %lu jobs, "
+         "%lu waits for room, %lu extra threads\n", stats.peak_threads,
+         (unsigned long)stats.threads_created,
+         (unsigned long)stats.threads_reaped,
+         (unsigned long)stats.jobs_started,
+         (unsigned long)stats.queue_full_waits,
+         (unsigned long)stats.extra_threads);
+  assert(stats.threads_created == stats.threads_reaped);
   return -1 + 1;
 }
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdexcept>
+#include <map>
+#include <string>
+#include <vector>
+#include "slab.hpp"
+
+static int live;
+
+struct alignas(64) widget {
+  int id;
+  std::string name;
+  widget(int id, const char *name) : id(id), name(name)
+  {
+    if (id < 0)
+      throw std::invalid_argument("bad id");
+    live++;
+  }
+  ~widget() { live--; }
+};
+
+static void test_slab()
+{
+  parlib::slab<widget> widgets("widgets");
+  std::vector<widget*> objs;
+
+  static_assert(parlib::slab<widget>::object_align == 64, "alignment");
+  for (int i = 0; i < 1000; i++) {
+    widget *w = widgets.create(i, "widget");
+    assert(!((uintptr_t)w % alignof(widget)));
+    objs.push_back(w);
+  }
+  assert(live == 1000);
+  for (int i = 0; i < 1000; i++) {
+    assert(objs[i]->id == i && objs[i]->name == "widget");
+    widgets.destroy(objs[i]);
+  }
+  assert(live == 0);
+
+  {
+    auto w = widgets.make_unique(7, "unique");
+    assert(w->id == 7 && live == 1);
+  }
+  assert(live == 0);
+
+  /* A throwing constructor gives its buffer back */
+  try {
+    widgets.create(-1, "bad");
+    assert(0);
+  } catch (std::invalid_argument &) {
+  }
+  struct slab_stats st = widgets.stats();
+  assert(st.allocs == st.frees);
+  assert(live == 0);
+}
+
+static void test_resource()
+{
+  std::pmr::memory_resource *mr = parlib::slab_resource();
+  std::pmr::vector<int> v(mr);
+  std::pmr::map<int, std::pmr::string> m(mr);
+
+  for (int i = 0; i < 100000; i++)
+    v.push_back(i);
+  for (int i = 0; i < 1000; i++)
+    m.emplace(i, "a string too long for the small string buffer");
+  for (int i = 0; i < 100000; i++)
+    assert(v[i] == i);
+  assert(m.size() == 1000 && m[10].size() > 16);
+
+  void *buf = mr->allocate(100, 256);
+  assert(!((uintptr_t)buf % 256));
+  mr->deallocate(buf, 100, 256);
+  parlib::slab_memory_resource other;
+  assert(mr->is_equal(other));
+}
+
+int main(int argc, char** argv)
+{
+  test_slab();
+  test_resource();
+  printf("Test passed\n");
+  return 0;
+}
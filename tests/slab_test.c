@@ -1,5 +1,11 @@
 #include <slab.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <vcore.h>
+#include <timing.h>
+#include <unistd.h>
 
 static void test_single_cache(int iters, size_t size, int align, int flags,
                               void (*ctor)(void *, size_t),
@@ -30,9 +36,197 @@ void a_dtor(void *buf, size_t size)
 	printf("destructin tests\n");
 }
 
-int main(void)
+/* Outside of vcores, everything goes straight to the slab layer, so the counts
+ * are exact. */
+static void __print_cache_name(struct slab_cache *cp, void *arg)
 {
+	struct slab_stats st;
+	slab_cache_stats(cp, &st);
+	printf("%s: %zu bytes in use, %zu mapped\n", st.name, st.bytes_in_use,
+	       st.bytes_mapped);
+	(*(int*)arg)++;
+}
+
+static void test_stats(void)
+{
+	struct slab_cache *cache;
+	struct slab_stats st;
+	void *objects[1000];
+	int nr_caches = 0;
+
+	cache = slab_cache_create("stats_cache", 100, 8, 0, 0, 0);
+	for (int i = 0; i < 1000; i++)
+		objects[i] = slab_cache_alloc(cache, 0);
+	for (int i = 0; i < 500; i++)
+		slab_cache_free(cache, objects[i]);
+	slab_cache_stats(cache, &st);
+	assert(st.allocs == 1000 && st.slab_allocs == 1000);
+	assert(st.frees == 500 && st.slab_frees == 500);
+	assert(st.bytes_in_use == 500 * 100);
+	assert(st.bytes_mapped >= st.bytes_in_use);
+	assert(st.grows == st.nr_full_slabs + st.nr_partial_slabs +
+	                   st.nr_empty_slabs);
+
+	for (int i = 500; i < 1000; i++)
+		slab_cache_free(cache, objects[i]);
+	slab_cache_reap(cache);
+	slab_cache_stats(cache, &st);
+	assert(st.bytes_in_use == 0 && st.bytes_mapped == 0);
+	assert(st.reaps == st.grows && !st.nr_empty_slabs);
+
+	slab_cache_foreach(__print_cache_name, &nr_caches);
+	assert(nr_caches >= 3);
+	print_slab_cache(cache);
+	slab_cache_destroy(cache);
+}
+
+/* The background reaper frees what a cache didn't use over a whole interval,
+ * and nothing else: an idle cache loses its empty slabs, while one cycling
+ * through the same objects the whole time keeps them. */
+#define REAP_INTERVAL_USEC 20000
+#define REAP_OBJS 1000
+
+static void test_reaper(void)
+{
+	struct slab_cache *idle, *busy;
+	struct slab_stats idle_st, busy_st;
+	static void *objects[REAP_OBJS];
+	uint64_t busy_grows, begin;
+
+	idle = slab_cache_create("idle_cache", 256, 8, 0, 0, 0);
+	busy = slab_cache_create("busy_cache", 256, 8, 0, 0, 0);
+	for (int i = 0; i < REAP_OBJS; i++)
+		objects[i] = slab_cache_alloc(idle, 0);
+	for (int i = 0; i < REAP_OBJS; i++)
+		slab_cache_free(idle, objects[i]);
+	for (int i = 0; i < REAP_OBJS; i++)
+		objects[i] = slab_cache_alloc(busy, 0);
+	for (int i = 0; i < REAP_OBJS; i++)
+		slab_cache_free(busy, objects[i]);
+	slab_cache_stats(busy, &busy_st);
+	busy_grows = busy_st.grows;
+
+	slab_set_reap_interval(REAP_INTERVAL_USEC);
+	begin = read_tsc();
+	do {
+		for (int i = 0; i < REAP_OBJS; i++)
+			objects[i] = slab_cache_alloc(busy, 0);
+		for (int i = 0; i < REAP_OBJS; i++)
+			slab_cache_free(busy, objects[i]);
+		/* The reaper runs at idle priority, so give it the cpu */
+		usleep(1000);
+		slab_cache_stats(idle, &idle_st);
+	} while (idle_st.nr_empty_slabs && tsc2sec(read_tsc() - begin) < 10);
+	slab_set_reap_interval(0);
+
+	slab_cache_stats(busy, &busy_st);
+	printf("Reaper: idle cache %lu of %lu slabs reaped, busy cache %lu of %lu\n",
+	       (unsigned long)idle_st.reaps, (unsigned long)idle_st.grows,
+	       (unsigned long)busy_st.reaps, (unsigned long)busy_st.grows);
+	assert(idle_st.nr_empty_slabs == 0 && idle_st.reaps == idle_st.grows);
+	assert(busy_st.reaps == 0 && busy_st.grows == busy_grows);
+	slab_cache_destroy(idle);
+	slab_cache_destroy(busy);
+}
+
+/* Colouring benchmark: walk the first object of each of many slabs.  Without
+ * colouring, they all sit at the same page offset and fight over the same
+ * cache sets. */
+#define COLOUR_SLABS 4096
+#define COLOUR_PASSES 200
+
+static void test_colouring(int flags)
+{
+	struct slab_cache *cache;
+	static void *objects[COLOUR_SLABS * 3];
+	volatile long sum = 0;
+	uint64_t begin;
+
+	/* 1200 byte objects: three per page, with enough slack for 4 colours */
+	cache = slab_cache_create("colour_cache", 1200, 64, flags, 0, 0);
+	for (int i = 0; i < COLOUR_SLABS * 3; i++)
+		objects[i] = slab_cache_alloc(cache, 0);
+	begin = read_tsc();
+	for (int p = 0; p < COLOUR_PASSES; p++)
+		for (int i = 0; i < COLOUR_SLABS * 3; i += 3)
+			sum += *(long*)objects[i];
+	printf("%s: %.2f nsec per access\n",
+	       flags & SLAB_NO_COLOUR ? "Not coloured" : "Coloured",
+	       (double)tsc2nsec(read_tsc() - begin) / (COLOUR_PASSES * COLOUR_SLABS));
+	for (int i = 0; i < COLOUR_SLABS * 3; i++)
+		slab_cache_free(cache, objects[i]);
+	slab_cache_destroy(cache);
+}
+
+/* Throughput benchmark: every vcore allocates and frees batches of objects
+ * from one shared cache, as fast as it can.  Only run with --bench, since it
+ * takes over every vcore and exits from one of them. */
+#define BENCH_ITERS 1000000
+#define BENCH_BATCH 32
+
+static struct slab_cache *bench_cache;
+static volatile int bench_b1, bench_b2;
+static uint64_t bench_start;
+
+void vcore_entry()
+{
+	void *objs[BENCH_BATCH];
+
+	if (vcore_saved_ucontext) {
+		/* vcore_saved_ucontext is TLS, so read it before switching */
+		void *cuc = vcore_saved_ucontext;
+		set_tls_desc(vcore_saved_tls_desc);
+		parlib_setcontext(cuc);
+		assert(0);
+	}
+
+	__sync_fetch_and_add(&bench_b1, 1);
+	while (bench_b1 < max_vcores());
+	if (vcore_id() == 0)
+		bench_start = read_tsc();
+
+	for (int i = 0; i < BENCH_ITERS / BENCH_BATCH; i++) {
+		for (int j = 0; j < BENCH_BATCH; j++)
+			objs[j] = slab_cache_alloc(bench_cache, 0);
+		for (int j = 0; j < BENCH_BATCH; j++)
+			slab_cache_free(bench_cache, objs[j]);
+	}
+
+	__sync_fetch_and_add(&bench_b2, 1);
+	while (bench_b2 < max_vcores());
+	if (vcore_id() == 0) {
+		uint64_t usec = tsc2usec(read_tsc() - bench_start);
+		printf("%ld vcores: %lu alloc/free pairs in %lu usec (%.1f Mops/s)\n",
+		       max_vcores(), (unsigned long)BENCH_ITERS * max_vcores(),
+		       (unsigned long)usec, (double)BENCH_ITERS * max_vcores() / usec);
+		print_slab_cache(bench_cache);
+		exit(0);
+	}
+	vcore_yield();
+}
+
+static void bench_vcores(void)
+{
+	bench_cache = slab_cache_create("bench_cache", 64, 8, 0, 0, 0);
+	vcore_lib_init();
+	vcore_request(max_vcores());
+	__set_tls_desc(vcore_tls_descs(0), 0);
+	vcore_saved_ucontext = NULL;
+	vcore_entry();
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench_vcores();
+		return 0;
+	}
 	test_single_cache(10, 128, 512, 0, 0, 0);
 	test_single_cache(10, 128, 4, 0, a_ctor, a_dtor);
 	test_single_cache(10, 1024, 16, 0, 0, 0);
+	test_stats();
+	test_reaper();
+	test_colouring(SLAB_NO_COLOUR);
+	test_colouring(0);
+	return 0;
 }
@@ -27,6 +27,7 @@
 #include "tls.h"
 #include "vcore.h"
 #include "waitfreelist.h"
+#include "timing.h"
 
 #define printf_safe(...)           \
   printf(__VA_ARGS__)
@@ -34,10 +35,49 @@
 #define NUM_VCORES \
   max_vcores()
 
+#define NUM_ITEMS 20000
+#define BATCH_SIZE 100
+
+void *items[NUM_ITEMS];
+
 volatile int b1, b2;
 
 struct wfl wfl = WFL_INITIALIZER(wfl);
 
+/* Every vcore fills and drains a list that reclaims blocks, with a big burst
+ * now and then, so that blocks keep being unlinked and freed under load. */
+#define RECLAIM_ROUNDS 100
+#define RECLAIM_BURST 100
+#define RECLAIM_BIG_BURST 5000
+
+volatile int b3;
+struct wfl rwfl = WFL_INITIALIZER(rwfl);
+volatile uintptr_t inserted_sum, removed_sum;
+
+static void test_reclaim_vcores()
+{
+  uintptr_t ins = 0, rem = 0;
+  void *batch[BATCH_SIZE];
+  void *elm;
+  size_t n;
+
+  for (int r = 0; r < RECLAIM_ROUNDS; r++) {
+    int burst = r % 10 == 0 ? RECLAIM_BIG_BURST : RECLAIM_BURST;
+    for (int i = 0; i < burst; i++) {
+      uintptr_t item = ((uintptr_t)vcore_id() << 24) + i + 1;
+      wfl_insert(&rwfl, (void*)item);
+      ins += item;
+    }
+    for (int i = 0; i < burst / 2 && (elm = wfl_remove(&rwfl)); i++)
+      rem += (uintptr_t)elm;
+    while ((n = wfl_remove_batch(&rwfl, batch, BATCH_SIZE)) > 0)
+      for (size_t i = 0; i < n; i++)
+        rem += (uintptr_t)batch[i];
+  }
+  __sync_fetch_and_add(&inserted_sum, ins);
+  __sync_fetch_and_add(&removed_sum, rem);
+}
+
 void vcore_entry()
 {
   if(vcore_saved_ucontext) {
@@ -67,7 +107,26 @@ void vcore_entry()
   __sync_fetch_and_add(&b2, 1);
   while (b2 < NUM_VCORES);
 
+  test_reclaim_vcores();
+
+  __sync_fetch_and_add(&b3, 1);
+  while (b3 < NUM_VCORES);
+
   if (vcore_id() == 0) {
+    uintptr_t rem = 0;
+    void *elm;
+
+    /* Blocks were retired, and freed, while everyone was at it */
+    printf_safe("reclaim epochs under load: %ld\n", (long)rwfl.epoch);
+    assert(rwfl.epoch >= 2);
+    while ((elm = wfl_remove(&rwfl)))
+      rem += (uintptr_t)elm;
+    assert(inserted_sum == removed_sum + rem);
+    for (int i = 0; i < 4; i++)
+      wfl_reclaim(&rwfl);
+    assert(rwfl.limbo == NULL && rwfl.retired == NULL);
+    assert(wfl_capacity(&rwfl) <= 2 * WFL_BLOCK_SLOTS);
+    wfl_cleanup(&rwfl);
     wfl_cleanup(&wfl);
     exit(0);
   }
@@ -75,9 +134,99 @@ void vcore_entry()
   vcore_yield();
 }
 
+/* Single-threaded checks, and how long it takes to fill and drain a big list */
+void test_single()
+{
+  struct wfl list;
+  struct wfl_slot *slot;
+  void *elm;
+  int count = 0;
+  uint64_t begin;
+
+  wfl_init(&list);
+  slot = wfl_insert(&list, (void*)1);
+  assert(!wfl_insert_into(&list, slot, (void*)2));
+  assert(wfl_remove_from(&list, slot) == (void*)1);
+  assert(wfl_remove_from(&list, slot) == NULL);
+  assert(wfl_insert_into(&list, slot, (void*)3));
+  for (int i = 0; i < 100; i++)
+    wfl_insert(&list, (void*)(uintptr_t)(i % 2 ? 5 : 6));
+  assert(wfl_remove_all(&list, (void*)5) == 50);
+  assert(wfl_size(&list) == 51);
+  wfl_foreach_unsafe(elm, &list)
+    count++;
+  assert(count == 51);
+  while (wfl_remove(&list))
+    count--;
+  assert(count == 0 && wfl_size(&list) == 0);
+
+  begin = read_tsc();
+  for (int i = 1; i <= NUM_ITEMS; i++)
+    wfl_insert(&list, (void*)(uintptr_t)i);
+  printf_safe("fill: %.1f nsec per insert\n",
+              (double)tsc2nsec(read_tsc() - begin) / NUM_ITEMS);
+  assert(wfl_size(&list) == NUM_ITEMS);
+  assert(wfl_capacity(&list) >= NUM_ITEMS);
+  begin = read_tsc();
+  for (int i = 1; i <= NUM_ITEMS; i++)
+    assert(wfl_remove(&list) != NULL);
+  printf_safe("drain: %.1f nsec per remove\n",
+              (double)tsc2nsec(read_tsc() - begin) / NUM_ITEMS);
+  assert(wfl_remove(&list) == NULL);
+
+  /* The same in batches */
+  for (int i = 0; i < NUM_ITEMS; i++)
+    items[i] = (void*)(uintptr_t)(i + 1);
+  begin = read_tsc();
+  for (int i = 0; i < NUM_ITEMS; i += BATCH_SIZE)
+    wfl_insert_batch(&list, &items[i], BATCH_SIZE);
+  printf_safe("batched fill: %.1f nsec per insert\n",
+              (double)tsc2nsec(read_tsc() - begin) / NUM_ITEMS);
+  assert(wfl_size(&list) == NUM_ITEMS);
+  uintptr_t sum = 0;
+  size_t n, total = 0;
+  begin = read_tsc();
+  while ((n = wfl_remove_batch(&list, items, BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < n; i++)
+      sum += (uintptr_t)items[i];
+    total += n;
+  }
+  printf_safe("batched drain: %.1f nsec per remove\n",
+              (double)tsc2nsec(read_tsc() - begin) / NUM_ITEMS);
+  assert(total == NUM_ITEMS);
+  assert(sum == (uintptr_t)NUM_ITEMS * (NUM_ITEMS + 1) / 2);
+  assert(wfl_size(&list) == 0);
+  wfl_cleanup(&list);
+}
+
+/* A list that reclaims blocks gives back its peak capacity once drained */
+void test_reclaim()
+{
+  struct wfl list;
+
+  wfl_init(&list);
+  wfl_enable_reclaim(&list);
+  for (int i = 1; i <= NUM_ITEMS; i++)
+    wfl_insert(&list, (void*)(uintptr_t)i);
+  assert(wfl_capacity(&list) >= NUM_ITEMS);
+  for (int i = 1; i <= NUM_ITEMS; i++)
+    assert(wfl_remove(&list) != NULL);
+  for (int i = 0; i < 2; i++)
+    wfl_reclaim(&list);
+  printf_safe("capacity after drain: %ld\n", wfl_capacity(&list));
+  assert(wfl_capacity(&list) <= 2 * WFL_BLOCK_SLOTS);
+  assert(wfl_size(&list) == 0);
+  wfl_insert(&list, (void*)1);
+  assert(wfl_remove(&list) == (void*)1);
+  wfl_cleanup(&list);
+}
+
 int main()
 {
+  test_single();
+  test_reclaim();
   vcore_lib_init();
+  wfl_enable_reclaim(&rwfl);
   printf_safe("main, max_vcores: %ld\n", max_vcores());
   vcore_request(NUM_VCORES);
   __set_tls_desc(vcore_tls_descs(0), 0);